@@ -68,52 +68,29 @@
 -(NSString *) readContents:(NSError *__autoreleasing *) error{
     MOBI_RET mobi_ret;
     if (self.data != NULL){
-        const size_t maxlen = mobi_get_text_maxsize(self.data);
-        char *text = malloc(maxlen + 1);
-        if (text == NULL) {
-            *error = [self errorWithCode:MobiReaderErrorMemoryAllocationFailed message:@"Memory allocation failed"];
+        /* Extract text records one by one, unpack and convert them to utf-8,
+         malformed utf-8 is replaced, so that the text is always accepted by NSString */
+        MOBITextReader reader;
+        mobi_ret = mobi_text_reader_open(&reader, self.data, MOBI_TEXT_UTF8 | MOBI_TEXT_REPAIR);
+        if (mobi_ret != MOBI_SUCCESS) {
+            *error = [self errorWithCode:MobiReaderErrorParsingText message:@"Error parsing text"];
             return nil;
         }
-        /* Extract text records, unpack, merge and copy it to text string */
-        size_t length = maxlen;
-        mobi_ret = mobi_get_rawml(self.data, text, &length);
+        NSMutableData *text = [NSMutableData data];
+        const char *chunk;
+        size_t length;
+        while ((mobi_ret = mobi_text_reader_next(&reader, &chunk, &length)) == MOBI_SUCCESS && length > 0) {
+            [text appendBytes:chunk length:length];
+        }
+        mobi_text_reader_close(&reader);
         if (mobi_ret != MOBI_SUCCESS) {
-            free(text);
             *error = [self errorWithCode:MobiReaderErrorParsingText message:@"Error parsing text"];
             return nil;
         }
-        /* Work on utf-8 encoded text */
-        if (memcmp(text, REPLICA_MAGIC, 4) != 0 && mobi_is_cp1252(self.data)) {
-            /* extreme case in which each input character is converted
-             to 3-byte utf-8 sequence */
-            size_t out_length = 3 * length + 1;
-            char *out_text = malloc(out_length);
-            if (out_text == NULL) {
-                free(text);
-                *error = [self errorWithCode:MobiReaderErrorMemoryAllocationFailed message:@"Memory allocation failed"];
-                return nil;
-            }
-            mobi_ret = mobi_cp1252_to_utf8(out_text, text, &out_length, length);
-            free(text);
-            if (mobi_ret != MOBI_SUCCESS || out_length == 0) {
-                free(out_text);
-                *error = [self errorWithCode:MobiReaderErrorConversion message:@"conversion from cp1252 to utf8 failed"];
-                return nil;
-            }
-            text = malloc(out_length + 1);
-            if (text == NULL) {
-                free(out_text);
-                *error = [self errorWithCode:MobiReaderErrorMemoryAllocationFailed message:@"Memory allocation failed"];
-                return nil;
-            }
-            memcpy(text, out_text, out_length);
-            free(out_text);
-            text[out_length] = '\0';
-            length = out_length;
-        }
-        NSString *textString = [NSString stringWithUTF8String:text];
-        free(text);
-        return textString;
+        /* Text ends at first null character */
+        const char terminator = '\0';
+        [text appendBytes:&terminator length:1];
+        return [NSString stringWithUTF8String:text.bytes];
     }
     return nil;
 }
@@ -65,6 +65,26 @@ MOBIBuffer * buffer_init_null(const size_t len) {
 	return buf;
 }
 
+/**
+ @brief Initializer for MOBIBuffer structure viewing existing data
+ 
+ Unlike buffer_init_null(), it does not allocate memory, structure is provided by the caller,
+ usually on the stack. Data is not copied and must stay valid while the buffer is used.
+ Buffer must not be freed.
+ 
+ @param[in,out] buf MOBIBuffer structure to be initialized
+ @param[in] data Data held by the buffer
+ @param[in] len Size of data held by the buffer
+ @return Initialized buffer (same as buf)
+ */
+MOBIBuffer * buffer_init_view(MOBIBuffer *buf, unsigned char *data, const size_t len) {
+    buf->data = data;
+    buf->offset = 0;
+    buf->maxlen = len;
+    buf->error = MOBI_SUCCESS;
+    return buf;
+}
+
 /**
  @brief Adds 8-bit value to MOBIBuffer
  
@@ -111,8 +131,8 @@ void buffer_add32(MOBIBuffer *buf, const uint32_t data) {
         return;
     }
     unsigned char *buftr = buf->data + buf->offset;
-    *buftr++ = (uint8_t)((uint32_t)(data & 0xff000000U) >> 16);
-    *buftr++ = (uint8_t)((uint32_t)(data & 0xff0000U) >> 12);
+    *buftr++ = (uint8_t)((uint32_t)(data & 0xff000000U) >> 24);
+    *buftr++ = (uint8_t)((uint32_t)(data & 0xff0000U) >> 16);
     *buftr++ = (uint8_t)((uint32_t)(data & 0xff00U) >> 8);
     *buftr = (uint8_t)((uint32_t)(data & 0xffU));
     buf->offset += 4;
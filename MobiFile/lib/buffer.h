@@ -26,6 +26,7 @@ typedef struct {
 
 MOBIBuffer * buffer_init(const size_t len);
 MOBIBuffer * buffer_init_null(const size_t len);
+MOBIBuffer * buffer_init_view(MOBIBuffer *buf, unsigned char *data, const size_t len);
 void buffer_add8(MOBIBuffer *buf, const uint8_t data);
 void buffer_add16(MOBIBuffer *buf, const uint16_t data);
 void buffer_add32(MOBIBuffer *buf, const uint32_t data);
@@ -9,6 +9,7 @@
  * See <http://www.gnu.org/licenses/>
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "compression.h"
 #include "buffer.h"
@@ -22,6 +23,9 @@
  Decompressor based on this algorithm:
  http://en.wikibooks.org/wiki/Data_Compression/Dictionary_compression#PalmDoc
 
+ Works directly on memory pointers, bounds are checked once per token.
+ Runs of literal chars are copied with memcpy, non-overlapping matches with 8-byte words.
+
  @param[out] out Decompressed destination data
  @param[in] in Compressed source data
  @param[in,out] len_out Size of the memory reserved for decompressed data.
@@ -31,77 +35,308 @@
  */
 MOBI_RET mobi_decompress_lz77(unsigned char *out, const unsigned char *in, size_t *len_out, const size_t len_in) {
     MOBI_RET ret = MOBI_SUCCESS;
-    MOBIBuffer *buf_in = buffer_init_null(len_in);
-    if (buf_in == NULL) {
-        return MOBI_MALLOC_FAILED;
-    }
-    MOBIBuffer *buf_out = buffer_init_null(*len_out);
-    if (buf_out == NULL) {
-        buffer_free_null(buf_in);
-        return MOBI_MALLOC_FAILED;
-    }
-    /* FIXME: is it ok to cast const to non-const here */
-    /* or is there a better way? */
-    buf_in->data = (unsigned char *) in;
-    buf_out->data = out;
-    while (ret == MOBI_SUCCESS && buf_in->offset < buf_in->maxlen) {
-        uint8_t byte = buffer_get8(buf_in);
+    const unsigned char *in_ptr = in;
+    const unsigned char *in_end = in + len_in;
+    unsigned char *out_ptr = out;
+    unsigned char *out_end = out + *len_out;
+    while (in_ptr < in_end) {
+        const uint8_t byte = *in_ptr++;
         /* byte pair: space + char */
         if (byte >= 0xc0) {
-            buffer_add8(buf_out, ' ');
-            buffer_add8(buf_out, byte ^ 0x80);
+            if (out_end - out_ptr < 2) {
+                if (out_ptr < out_end) {
+                    *out_ptr++ = ' ';
+                }
+                ret = MOBI_BUFFER_END;
+                break;
+            }
+            *out_ptr++ = ' ';
+            *out_ptr++ = byte ^ 0x80;
         }
         /* length, distance pair */
         /* 0x8000 + (distance << 3) + ((length-3) & 0x07) */
         else if (byte >= 0x80) {
-            uint8_t next = buffer_get8(buf_in);
-            uint16_t distance = ((((byte << 8) | ((uint8_t)next)) >> 3) & 0x7ff);
-            uint8_t length = (next & 0x7) + 3;
+            uint8_t next = 0;
+            if (in_ptr < in_end) {
+                next = *in_ptr++;
+            } else {
+                /* truncated pair, copy is still done as if next byte was zero */
+                ret = MOBI_BUFFER_END;
+            }
+            const size_t distance = ((((byte << 8) | ((uint8_t)next)) >> 3) & 0x7ff);
+            size_t length = (next & 0x7) + 3;
+            if (distance == 0 || distance > (size_t) (out_ptr - out)) {
+                debug_print("LZ77 distance out of range: %zu\n", distance);
+                ret = MOBI_DATA_CORRUPT;
+                break;
+            }
+            const unsigned char *src = out_ptr - distance;
+            if (distance >= 8 && out_end - out_ptr >= 16) {
+                /* no overlap within 8-byte words, max length is 10, bytes written past length are overwritten later */
+                memcpy(out_ptr, src, 8);
+                memcpy(out_ptr + 8, src + 8, 8);
+                out_ptr += length;
+                if (ret != MOBI_SUCCESS) {
+                    break;
+                }
+                continue;
+            }
+            if (length > (size_t) (out_end - out_ptr)) {
+                length = (size_t) (out_end - out_ptr);
+                ret = MOBI_BUFFER_END;
+            }
+            /* overlapping copy must go byte by byte */
             while (length--) {
-                buffer_add8(buf_out, *(buf_out->data + buf_out->offset - distance));
+                *out_ptr++ = *src++;
+            }
+            if (ret != MOBI_SUCCESS) {
+                break;
             }
         }
-        /* single char, not modified */
+        /* single chars, not modified */
         else if (byte >= 0x09) {
-            buffer_add8(buf_out, byte);
+            /* copy whole run of such chars at once */
+            const unsigned char *run_end = in_ptr;
+            while (run_end < in_end && *run_end >= 0x09 && *run_end < 0x80) {
+                run_end++;
+            }
+            size_t length = (size_t) (run_end - in_ptr) + 1;
+            if (length > (size_t) (out_end - out_ptr)) {
+                length = (size_t) (out_end - out_ptr);
+                ret = MOBI_BUFFER_END;
+            }
+            memcpy(out_ptr, in_ptr - 1, length);
+            out_ptr += length;
+            in_ptr += length - 1;
+            if (ret != MOBI_SUCCESS) {
+                break;
+            }
         }
         /* val chars not modified */
         else if (byte >= 0x01) {
-            buffer_copy(buf_out, buf_in, byte);
+            if (byte > (size_t) (in_end - in_ptr) || byte > (size_t) (out_end - out_ptr)) {
+                ret = MOBI_BUFFER_END;
+                break;
+            }
+            memcpy(out_ptr, in_ptr, byte);
+            out_ptr += byte;
+            in_ptr += byte;
         }
-        /* char '\0', not modified */
+        /* char '\0', following byte is copied */
         else {
-            buffer_copy8(buf_out, buf_in);
-        }
-        if (buf_in->error || buf_out->error) {
-            ret = MOBI_BUFFER_END;
+            if (out_ptr == out_end) {
+                ret = MOBI_BUFFER_END;
+                break;
+            }
+            if (in_ptr == in_end) {
+                *out_ptr++ = '\0';
+                ret = MOBI_BUFFER_END;
+                break;
+            }
+            *out_ptr++ = *in_ptr++;
         }
     }
-    *len_out = buf_out->offset;
-    buffer_free_null(buf_out);
-    buffer_free_null(buf_in);
+    *len_out = (size_t) (out_ptr - out);
     return ret;
 }
 
 /**
- @brief Read at most 8 bytes from buffer, big-endian
+ @brief Check if byte must be stored in a run of literal chars by PalmDOC compressor
+ 
+ Bytes 0x09-0x7f are stored as they are, other bytes have special meaning for decompressor.
+ 
+ @param[in] byte Input byte
+ @return True if byte must be escaped
+ */
+static MOBI_INLINE bool mobi_lz77_needs_escape(const unsigned char byte) {
+    return byte < 0x09 || byte >= 0x80;
+}
+
+/**
+ @brief Hash of 3 bytes used by PalmDOC compressor to find matches
+ 
+ @param[in] data Input data, at least 3 bytes
+ @return Hash value of MOBI_LZ77_HASH_BITS bits
+ */
+static MOBI_INLINE uint32_t mobi_lz77_hash(const unsigned char *data) {
+    const uint32_t value = (uint32_t) data[0] << 16 | (uint32_t) data[1] << 8 | (uint32_t) data[2];
+    return (value * 2654435761U) >> (32 - MOBI_LZ77_HASH_BITS);
+}
+
+/**
+ @brief Compressor for PalmDOC version of LZ77 compression
  
- If buffer data is shorter returned value is padded with zeroes
+ Matches of 3 to 10 bytes within 2047 bytes window are found with hash chains.
+ Level sets maximal number of hash chain entries checked for each position:
+ 0 - no matches, only space + char pairs are used, 1 - single entry,
+ each following level doubles the number, up to MOBI_LZ77_LEVEL_MAX.
+ Chars with special meaning for decompressor (0x00-0x08, 0x80-0xff) are stored in runs of up to 8 literal chars.
+ Output may be up to 1.5 times longer than input.
  
- @param[in] buf MOBIBuffer structure to read from
- @return 64-bit value
+ @param[out] out Compressed destination data
+ @param[in] in Uncompressed source data
+ @param[in,out] len_out Size of the memory reserved for compressed data.
+ On return it is set to actual size of compressed data
+ @param[in] len_in Size of uncompressed data
+ @param[in] level Compression level, from 0 (fastest) to MOBI_LZ77_LEVEL_MAX (best ratio)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-static MOBI_INLINE uint64_t buffer_fill64(MOBIBuffer *buf) {
+MOBI_RET mobi_compress_lz77(unsigned char *out, const unsigned char *in, size_t *len_out, const size_t len_in, const int level) {
+    if (level < 0 || level > MOBI_LZ77_LEVEL_MAX) {
+        debug_print("Wrong compression level: %i\n", level);
+        return MOBI_PARAM_ERR;
+    }
+    /* most recent position for each hash, previous position with the same hash for each position in window */
+    int32_t head[1 << MOBI_LZ77_HASH_BITS];
+    int32_t prev[MOBI_LZ77_WINDOW + 1];
+    memset(head, 0xff, sizeof(head));
+    const size_t max_chain = level ? (size_t) 1 << (level - 1) : 0;
+    /* at lower levels positions inside matches are not hashed */
+    const bool hash_all = (level >= 4);
+    unsigned char *out_ptr = out;
+    const unsigned char *out_end = out + *len_out;
+    size_t i = 0;
+    size_t hashed = 0;
+    while (i < len_in) {
+        size_t best_length = 0;
+        size_t best_distance = 0;
+        if (max_chain && i + 3 <= len_in) {
+            /* add skipped positions to hash chains */
+            if (!hash_all && hashed < i) {
+                hashed = i;
+            }
+            while (hashed < i) {
+                const uint32_t hash = mobi_lz77_hash(in + hashed);
+                prev[hashed & MOBI_LZ77_WINDOW] = head[hash];
+                head[hash] = (int32_t) hashed;
+                hashed++;
+            }
+            const uint32_t hash = mobi_lz77_hash(in + i);
+            const size_t max_length = (len_in - i < MOBI_LZ77_MATCH_MAX) ? len_in - i : MOBI_LZ77_MATCH_MAX;
+            int32_t candidate = head[hash];
+            size_t chain = max_chain;
+            while (candidate >= 0 && i - (size_t) candidate <= MOBI_LZ77_WINDOW && chain--) {
+                const unsigned char *match = in + candidate;
+                if (match[best_length] == in[i + best_length]) {
+                    size_t length = 0;
+                    while (length < max_length && match[length] == in[i + length]) {
+                        length++;
+                    }
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = i - (size_t) candidate;
+                        if (length == max_length) {
+                            break;
+                        }
+                    }
+                }
+                const int32_t next = prev[candidate & MOBI_LZ77_WINDOW];
+                if (next >= candidate) {
+                    break;
+                }
+                candidate = next;
+            }
+            prev[i & MOBI_LZ77_WINDOW] = head[hash];
+            head[hash] = (int32_t) i;
+            hashed = i + 1;
+        }
+        const bool space_pair = (in[i] == ' ' && i + 1 < len_in && in[i + 1] >= 0x40 && in[i + 1] < 0x80);
+        /* space + char pair is as short as 3 bytes match, and leaves the next char for another match */
+        if (best_length > 3 || (best_length == 3 && !space_pair)) {
+            if (out_end - out_ptr < 2) {
+                return MOBI_BUFFER_END;
+            }
+            const uint16_t pair = (uint16_t) (0x8000 | (best_distance << 3) | (best_length - 3));
+            *out_ptr++ = (unsigned char) (pair >> 8);
+            *out_ptr++ = (unsigned char) pair;
+            i += best_length;
+        } else if (space_pair) {
+            if (out_end - out_ptr < 1) {
+                return MOBI_BUFFER_END;
+            }
+            *out_ptr++ = in[i + 1] ^ 0x80;
+            i += 2;
+        } else if (!mobi_lz77_needs_escape(in[i])) {
+            if (out_end - out_ptr < 1) {
+                return MOBI_BUFFER_END;
+            }
+            *out_ptr++ = in[i++];
+        } else {
+            size_t length = 1;
+            while (length < 8 && i + length < len_in && mobi_lz77_needs_escape(in[i + length])) {
+                length++;
+            }
+            if ((size_t) (out_end - out_ptr) < length + 1) {
+                return MOBI_BUFFER_END;
+            }
+            *out_ptr++ = (unsigned char) length;
+            memcpy(out_ptr, in + i, length);
+            out_ptr += length;
+            i += length;
+        }
+    }
+    *len_out = (size_t) (out_ptr - out);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Read 8 bytes starting at given bit position, big-endian, aligned to the most significant bit
+ 
+ If data is shorter returned value is padded with zeroes
+ 
+ @param[in] data Data to read from
+ @param[in] length Length of the data
+ @param[in] bitpos Bit position to start from
+ @return 64-bit value with at least 57 valid bits
+ */
+static MOBI_INLINE uint64_t mobi_huffman_fill(const unsigned char *data, const size_t length, const size_t bitpos) {
+    const size_t pos = bitpos >> 3;
+    const unsigned char *p = data + pos;
     uint64_t val = 0;
-    uint8_t i = 8;
-    size_t bytesleft = buf->maxlen - buf->offset;
-    unsigned char *ptr = buf->data + buf->offset;
-    while (i-- && bytesleft--) {
-        val |= (uint64_t) *ptr++ << (i * 8);
+    if (pos + 8 <= length) {
+        /* unaligned big-endian load, compilers turn it into single load and byte swap */
+        val = (uint64_t) p[0] << 56 | (uint64_t) p[1] << 48 | (uint64_t) p[2] << 40 | (uint64_t) p[3] << 32
+            | (uint64_t) p[4] << 24 | (uint64_t) p[5] << 16 | (uint64_t) p[6] << 8 | (uint64_t) p[7];
+    } else if (pos < length) {
+        size_t bytesleft = length - pos;
+        uint8_t shift = 56;
+        while (bytesleft--) {
+            val |= (uint64_t) *p++ << shift;
+            shift -= 8;
+        }
+    }
+    return val << (bitpos & 7);
+}
+
+/**
+ @brief Store expanded huffman symbol in cache
+ 
+ Arena space is reserved atomically, so the cache may be shared by threads decompressing records concurrently.
+ Symbol is not stored if it is already cached or the arena is full.
+ 
+ @param[in,out] cache MOBIHuffCache structure
+ @param[in] index Index of the symbol
+ @param[in] data Expanded symbol
+ @param[in] length Length of expanded symbol
+ */
+static void mobi_huffcache_add(MOBIHuffCache *cache, const uint32_t index, const unsigned char *data, const size_t length) {
+    if (__atomic_load_n(&cache->entries[index], __ATOMIC_RELAXED) != NULL) {
+        return;
+    }
+    const size_t needed = sizeof(uint32_t) + length;
+    if (__atomic_load_n(&cache->used, __ATOMIC_RELAXED) + needed > cache->size) {
+        return;
+    }
+    const size_t start = __atomic_fetch_add(&cache->used, needed, __ATOMIC_RELAXED);
+    if (start + needed > cache->size) {
+        return;
     }
-    /* increase counter by 4 bytes only, 4 bytes overlap on each call */
-    buf->offset += 4;
-    return val;
+    unsigned char *entry = cache->data + start;
+    const uint32_t entry_length = (uint32_t) length;
+    memcpy(entry, &entry_length, sizeof(uint32_t));
+    memcpy(entry + sizeof(uint32_t), data, length);
+    unsigned char *expected = NULL;
+    __atomic_compare_exchange_n(&cache->entries[index], &expected, entry, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
 }
 
 /**
@@ -112,70 +347,108 @@ static MOBI_INLINE uint64_t buffer_fill64(MOBIBuffer *buf) {
  python mobiunpack.py, calibre
  
  @param[out] buf_out MOBIBuffer structure with decompressed data
- @param[in] buf_in MOBIBuffer structure with compressed data
+ @param[in] in Compressed data
+ @param[in] len_in Size of compressed data
  @param[in] huffcdic MOBIHuffCdic structure with parsed data from huff/cdic records
  @param[in] depth Depth of current recursion level
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-static MOBI_RET mobi_decompress_huffman_internal(MOBIBuffer *buf_out, MOBIBuffer *buf_in, const MOBIHuffCdic *huffcdic, size_t depth) {
+static MOBI_RET mobi_decompress_huffman_internal(MOBIBuffer *buf_out, const unsigned char *in, const size_t len_in, const MOBIHuffCdic *huffcdic, size_t depth) {
     if (depth > MOBI_HUFFMAN_MAXDEPTH) {
         debug_print("Too many levels of recursion: %zu\n", depth);
         return MOBI_DATA_CORRUPT;
     }
     MOBI_RET ret = MOBI_SUCCESS;
-    int8_t bitcount = 32;
-    /* this cast should be safe: max record size is 4096 */
-    int bitsleft = (int) (buf_in->maxlen * 8);
-    uint8_t code_length = 0;
-    uint64_t buffer = buffer_fill64(buf_in);
+    const size_t bits_total = len_in * 8;
+    size_t bitpos = 0;
+    /* bit reservoir, next code is in the most significant bits */
+    uint64_t reservoir = 0;
+    uint32_t reservoir_bits = 0;
     while (ret == MOBI_SUCCESS) {
-        if (bitcount <= 0) {
-            bitcount += 32;
-            buffer = buffer_fill64(buf_in);
+        if (reservoir_bits < 32) {
+            reservoir = mobi_huffman_fill(in, len_in, bitpos);
+            reservoir_bits = 64 - (bitpos & 7);
         }
-        uint32_t code = (buffer >> bitcount) & 0xffffffffU;
+        const uint32_t code = (uint32_t) (reservoir >> 32);
         /* lookup code in table1 */
-        uint32_t t1 = huffcdic->table1[code >> 24];
+        const uint32_t t1 = huffcdic->table1[code >> 24];
         /* get maxcode and codelen from t1 */
-        code_length = t1 & 0x1f;
-        uint32_t maxcode = (((t1 >> 8) + 1) << (32 - code_length)) - 1;
+        uint32_t code_length = t1 & 0x1f;
+        uint32_t maxcode;
         /* check termination bit */
-        if (!(t1 & 0x80)) {
+        if (t1 & 0x80) {
+            if (code_length == 0) {
+                debug_print("%s", "Invalid huffman code length\n");
+                return MOBI_DATA_CORRUPT;
+            }
+            maxcode = (((t1 >> 8) + 1) << (32 - code_length)) - 1;
+        } else {
+            /* lengths up to 16 bits are resolved by 16-bit prefix */
+            if (huffcdic->table2) {
+                code_length = huffcdic->table2[code >> 16];
+            }
             /* get offset from mincode, maxcode tables */
-            while (code < huffcdic->mincode_table[code_length]) {
+            while (code_length <= 32 && code < huffcdic->mincode_table[code_length]) {
                 code_length++;
             }
+            if (code_length == 0 || code_length > 32) {
+                debug_print("%s", "Invalid huffman code length\n");
+                return MOBI_DATA_CORRUPT;
+            }
             maxcode = huffcdic->maxcode_table[code_length];
         }
-        bitcount -= code_length;
-        bitsleft -= code_length;
-        if (bitsleft < 0) {
+        bitpos += code_length;
+        if (bitpos > bits_total) {
             break;
         }
+        /* code_length is at most 32, reservoir holds at least 32 bits */
+        reservoir <<= code_length;
+        reservoir_bits -= code_length;
         /* get index for symbol offset */
-        uint32_t index = (uint32_t) (maxcode - code) >> (32 - code_length);
+        const uint32_t index = (uint32_t) (maxcode - code) >> (32 - code_length);
+        if (index >= huffcdic->index_read) {
+            debug_print("Huffman symbol index out of range: %u\n", index);
+            return MOBI_DATA_CORRUPT;
+        }
         /* check which part of cdic to use */
-        uint8_t cdic_index = (uint8_t) ((uint32_t)index >> huffcdic->code_length);
+        const uint32_t cdic_index = index >> huffcdic->code_length;
         /* get offset */
-        uint32_t offset = huffcdic->symbol_offsets[index];
-        uint32_t symbol_length = (uint32_t) huffcdic->symbols[cdic_index][offset] << 8 | (uint32_t) huffcdic->symbols[cdic_index][offset + 1];
+        const uint32_t offset = huffcdic->symbol_offsets[index];
+        const unsigned char *symbol = huffcdic->symbols[cdic_index] + offset;
+        uint32_t symbol_length = (uint32_t) symbol[0] << 8 | (uint32_t) symbol[1];
         /* 1st bit is is_decompressed flag */
-        int is_decompressed = symbol_length >> 15;
+        const int is_decompressed = symbol_length >> 15;
         /* get rid of flag */
         symbol_length &= 0x7fff;
         if (is_decompressed) {
             /* symbol is at (offset + 2), 2 bytes used earlier for symbol length */
-            buffer_addraw(buf_out, (huffcdic->symbols[cdic_index] + offset + 2), symbol_length);
-            ret = buf_out->error;
+            if (symbol_length <= buf_out->maxlen - buf_out->offset) {
+                memcpy(buf_out->data + buf_out->offset, symbol + 2, symbol_length);
+                buf_out->offset += symbol_length;
+            } else {
+                buffer_addraw(buf_out, symbol + 2, symbol_length);
+                ret = buf_out->error;
+            }
         } else {
             /* symbol is compressed */
-            /* TODO cache uncompressed symbols? */
-            MOBIBuffer buf_sym;
-            buf_sym.data = huffcdic->symbols[cdic_index] + offset + 2;
-            buf_sym.offset = 0;
-            buf_sym.maxlen = symbol_length;
-            buf_sym.error = MOBI_SUCCESS;
-            ret = mobi_decompress_huffman_internal(buf_out, &buf_sym, huffcdic, depth + 1);
+            MOBIHuffCache *cache = huffcdic->cache;
+            if (cache) {
+                const unsigned char *cached = __atomic_load_n(&cache->entries[index], __ATOMIC_ACQUIRE);
+                if (cached) {
+                    uint32_t cached_length;
+                    memcpy(&cached_length, cached, sizeof(uint32_t));
+                    if (cached_length <= buf_out->maxlen - buf_out->offset) {
+                        memcpy(buf_out->data + buf_out->offset, cached + sizeof(uint32_t), cached_length);
+                        buf_out->offset += cached_length;
+                        continue;
+                    }
+                }
+            }
+            const size_t start = buf_out->offset;
+            ret = mobi_decompress_huffman_internal(buf_out, symbol + 2, symbol_length, huffcdic, depth + 1);
+            if (cache && ret == MOBI_SUCCESS) {
+                mobi_huffcache_add(cache, index, buf_out->data + start, buf_out->offset - start);
+            }
         }
     }
     return ret;
@@ -197,22 +470,826 @@ static MOBI_RET mobi_decompress_huffman_internal(MOBIBuffer *buf_out, MOBIBuffer
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
 MOBI_RET mobi_decompress_huffman(unsigned char *out, const unsigned char *in, size_t *len_out, size_t len_in, const MOBIHuffCdic *huffcdic) {
-    MOBIBuffer *buf_in = buffer_init_null(len_in);
-    if (buf_in == NULL) {
+    MOBIBuffer buf_out_view;
+    MOBIBuffer *buf_out = buffer_init_view(&buf_out_view, out, *len_out);
+    MOBI_RET ret = mobi_decompress_huffman_internal(buf_out, in, len_in, huffcdic, 0);
+    *len_out = buf_out->offset;
+    return ret;
+}
+
+#define MOBI_FNV_BASIS 2166136261U /**< FNV-1a hash offset basis */
+#define MOBI_FNV_PRIME 16777619U /**< FNV-1a hash prime */
+
+/**
+ @brief Add byte to FNV-1a hash of huffman dictionary symbol
+ 
+ Hashes of all prefixes of a string are computed incrementally while searching for matching symbols.
+ 
+ @param[in] hash Hash of preceding bytes
+ @param[in] byte Next byte
+ @return Updated hash
+ */
+static MOBI_INLINE uint32_t mobi_huffdict_hash_add(const uint32_t hash, const unsigned char byte) {
+    return (hash ^ byte) * MOBI_FNV_PRIME;
+}
+
+/**
+ @brief FNV-1a hash of huffman dictionary symbol
+ 
+ @param[in] data Symbol data
+ @param[in] length Symbol length
+ @return Hash value
+ */
+static uint32_t mobi_huffdict_hash(const unsigned char *data, size_t length) {
+    uint32_t hash = MOBI_FNV_BASIS;
+    while (length--) {
+        hash = mobi_huffdict_hash_add(hash, *data++);
+    }
+    return hash;
+}
+
+/**
+ @brief Estimate if symbol is worth adding to huffman dictionary
+ 
+ Each occurrence saves roughly one code in compressed text, about 10 bits,
+ while the symbol itself takes its data and 4 bytes of offset and length in CDIC record.
+ 
+ @param[in] count Number of occurrences in text
+ @param[in] length Symbol length
+ @return True if symbol should make compressed output shorter
+ */
+static MOBI_INLINE bool mobi_huffdict_worth(const size_t count, const size_t length) {
+    return count * 10 > (length + 4) * 8;
+}
+
+/**
+ @brief Check if byte is a part of a word for the purpose of huffman dictionary building
+ 
+ Bytes of multibyte characters are treated as letters.
+ 
+ @param[in] byte Byte to check
+ @return True if byte is alphanumeric or non-ascii
+ */
+static MOBI_INLINE bool mobi_huffdict_is_word(const unsigned char byte) {
+    return (byte >= '0' && byte <= '9') || (byte >= 'A' && byte <= 'Z') || (byte >= 'a' && byte <= 'z') || byte >= 0x80;
+}
+
+/**
+ @brief Initialize empty huffman dictionary
+ 
+ @return Initialized MOBIHuffDict structure or NULL on failure
+ */
+static MOBIHuffDict * mobi_init_huffdict(void) {
+    MOBIHuffDict *dict = calloc(1, sizeof(MOBIHuffDict));
+    if (dict == NULL) {
+        debug_print("%s", "Memory allocation for huffman dictionary failed\n");
+        return NULL;
+    }
+    dict->max_length = calloc(0x10000, sizeof(*dict->max_length));
+    if (dict->max_length == NULL) {
+        debug_print("%s", "Memory allocation for huffman dictionary failed\n");
+        free(dict);
+        return NULL;
+    }
+    for (size_t i = 0; i < 256; i++) {
+        dict->bytes[i] = (unsigned char) i;
+    }
+    return dict;
+}
+
+/**
+ @brief Free huffman dictionary
+ 
+ @param[in] dict MOBIHuffDict structure
+ */
+void mobi_free_huffdict(MOBIHuffDict *dict) {
+    if (dict == NULL) {
+        return;
+    }
+    free(dict->symbols);
+    free(dict->lengths);
+    free(dict->counts);
+    free(dict->code_lengths);
+    free(dict->codes);
+    free(dict->slots);
+    free(dict->max_length);
+    free(dict);
+}
+
+/**
+ @brief Find symbol in huffman dictionary
+ 
+ @param[in] dict MOBIHuffDict structure
+ @param[in] data Symbol data
+ @param[in] length Symbol length
+ @param[in] hash Hash of the symbol
+ @return Index of the symbol or SIZE_MAX if not found
+ */
+static size_t mobi_huffdict_find(const MOBIHuffDict *dict, const unsigned char *data, const size_t length, const uint32_t hash) {
+    if (dict->slots == NULL) {
+        return SIZE_MAX;
+    }
+    size_t slot = (hash ^ (hash >> 15)) & dict->slots_mask;
+    uint32_t entry;
+    while ((entry = dict->slots[slot]) != 0) {
+        const size_t index = entry - 1;
+        if (dict->lengths[index] == length && memcmp(dict->symbols[index], data, length) == 0) {
+            return index;
+        }
+        slot = (slot + 1) & dict->slots_mask;
+    }
+    return SIZE_MAX;
+}
+
+/**
+ @brief Insert symbol into hash table and prefix lengths table of huffman dictionary
+ 
+ @param[in,out] dict MOBIHuffDict structure
+ @param[in] index Index of the symbol
+ */
+static void mobi_huffdict_insert(MOBIHuffDict *dict, const size_t index) {
+    const unsigned char *data = dict->symbols[index];
+    const uint8_t length = dict->lengths[index];
+    const uint32_t hash = mobi_huffdict_hash(data, length);
+    size_t slot = (hash ^ (hash >> 15)) & dict->slots_mask;
+    while (dict->slots[slot] != 0) {
+        slot = (slot + 1) & dict->slots_mask;
+    }
+    dict->slots[slot] = (uint32_t) index + 1;
+    if (length >= 2) {
+        const size_t prefix = (size_t) data[0] << 8 | data[1];
+        if (dict->max_length[prefix] < length) {
+            dict->max_length[prefix] = length;
+        }
+    }
+}
+
+/**
+ @brief Rebuild hash table of huffman dictionary, sized for given number of symbols
+ 
+ @param[in,out] dict MOBIHuffDict structure
+ @param[in] capacity Number of symbols the table must hold
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffdict_rehash(MOBIHuffDict *dict, const size_t capacity) {
+    /* keep load factor at most 0.5 */
+    size_t slots_count = 1024;
+    while (slots_count < capacity * 2) {
+        slots_count <<= 1;
+    }
+    uint32_t *slots = calloc(slots_count, sizeof(*slots));
+    if (slots == NULL) {
+        debug_print("%s", "Memory allocation for huffman dictionary failed\n");
         return MOBI_MALLOC_FAILED;
     }
-    MOBIBuffer *buf_out = buffer_init_null(*len_out);
-    if (buf_out == NULL) {
-        buffer_free_null(buf_in);
+    free(dict->slots);
+    dict->slots = slots;
+    dict->slots_mask = slots_count - 1;
+    memset(dict->max_length, 0, 0x10000 * sizeof(*dict->max_length));
+    for (size_t i = 0; i < dict->count; i++) {
+        mobi_huffdict_insert(dict, i);
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Append symbol to huffman dictionary
+ 
+ Symbol must not be already present in the dictionary. Symbol data is not copied.
+ 
+ @param[in,out] dict MOBIHuffDict structure
+ @param[in] data Symbol data
+ @param[in] length Symbol length
+ @param[in] count Initial count of the symbol
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffdict_add(MOBIHuffDict *dict, const unsigned char *data, const size_t length, const uint32_t count) {
+    if (dict->count == dict->capacity) {
+        const size_t capacity = dict->capacity ? dict->capacity * 2 : 1024;
+        const unsigned char **symbols = realloc(dict->symbols, capacity * sizeof(*dict->symbols));
+        if (symbols) {
+            dict->symbols = symbols;
+        }
+        uint8_t *lengths = realloc(dict->lengths, capacity * sizeof(*dict->lengths));
+        if (lengths) {
+            dict->lengths = lengths;
+        }
+        uint32_t *counts = realloc(dict->counts, capacity * sizeof(*dict->counts));
+        if (counts) {
+            dict->counts = counts;
+        }
+        if (symbols == NULL || lengths == NULL || counts == NULL) {
+            debug_print("%s", "Memory allocation for huffman dictionary failed\n");
+            return MOBI_MALLOC_FAILED;
+        }
+        const MOBI_RET ret = mobi_huffdict_rehash(dict, capacity);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        dict->capacity = capacity;
+    }
+    const size_t index = dict->count++;
+    dict->symbols[index] = data;
+    dict->lengths[index] = (uint8_t) length;
+    dict->counts[index] = count;
+    mobi_huffdict_insert(dict, index);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Find all huffman dictionary symbols matching data at given position
+ 
+ @param[in] dict MOBIHuffDict structure
+ @param[in] data Data to match
+ @param[in] remaining Number of bytes available
+ @param[out] matches Indices of matching symbols, from the shortest, at least MOBI_HUFF_SYMBOL_MAX entries
+ @return Number of matching symbols
+ */
+static size_t mobi_huffdict_matches(const MOBIHuffDict *dict, const unsigned char *data, const size_t remaining, uint32_t *matches) {
+    size_t limit = 1;
+    if (remaining >= 2) {
+        limit = dict->max_length[(size_t) data[0] << 8 | data[1]];
+        if (limit > remaining) {
+            limit = remaining;
+        } else if (limit == 0) {
+            limit = 1;
+        }
+    }
+    uint32_t hash = MOBI_FNV_BASIS;
+    size_t found = 0;
+    for (size_t length = 1; length <= limit; length++) {
+        hash = mobi_huffdict_hash_add(hash, data[length - 1]);
+        const size_t index = mobi_huffdict_find(dict, data, length, hash);
+        if (index != SIZE_MAX) {
+            matches[found++] = (uint32_t) index;
+        }
+    }
+    return found;
+}
+
+/**
+ @brief Find shortest encoding of data with huffman dictionary symbols
+ 
+ Dynamic programming over positions, cost of each symbol is its code length.
+ 
+ @param[in] dict MOBIHuffDict structure with assigned code lengths
+ @param[in] data Data to encode
+ @param[in] length Length of the data
+ @param[out] cost Array of length + 1 entries, on return cost[i] is number of bits needed to encode data from position i
+ @param[out] choice Array of length entries, on return choice[i] is index of the first symbol in encoding from position i
+ */
+static void mobi_huffdict_parse(const MOBIHuffDict *dict, const unsigned char *data, const size_t length, uint32_t *cost, uint32_t *choice) {
+    uint32_t matches[MOBI_HUFF_SYMBOL_MAX];
+    cost[length] = 0;
+    for (size_t i = length; i-- > 0; ) {
+        const size_t found = mobi_huffdict_matches(dict, data + i, length - i, matches);
+        uint32_t best_cost = UINT32_MAX;
+        uint32_t best_index = 0;
+        for (size_t k = 0; k < found; k++) {
+            const uint32_t index = matches[k];
+            const uint32_t symbol_cost = dict->code_lengths[index] + cost[i + dict->lengths[index]];
+            /* on ties prefer longer symbol */
+            if (symbol_cost <= best_cost) {
+                best_cost = symbol_cost;
+                best_index = index;
+            }
+        }
+        cost[i] = best_cost;
+        choice[i] = best_index;
+    }
+}
+
+/**
+ @brief Count occurrences of huffman dictionary symbols in text
+ 
+ Text is parsed in chunks of record size, as compressed records are decoded independently.
+ Before codes are assigned, text is parsed greedily with the longest matching symbols,
+ later with the shortest encoding for current code lengths.
+ Optionally pairs of adjacent symbols are counted as candidates for new symbols.
+ 
+ @param[in,out] dict MOBIHuffDict structure, counts are updated
+ @param[in] text Text
+ @param[in] length Length of the text
+ @param[in] record_size Size of text record
+ @param[in,out] pairs MOBIHuffDict structure to count pairs of adjacent symbols, or NULL
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffdict_count(MOBIHuffDict *dict, const unsigned char *text, const size_t length, const size_t record_size, MOBIHuffDict *pairs) {
+    uint32_t *cost = NULL;
+    uint32_t *choice = NULL;
+    if (dict->code_lengths) {
+        cost = malloc((record_size + 1) * sizeof(*cost));
+        choice = malloc(record_size * sizeof(*choice));
+        if (cost == NULL || choice == NULL) {
+            debug_print("%s", "Memory allocation for huffman parser failed\n");
+            free(cost);
+            free(choice);
+            return MOBI_MALLOC_FAILED;
+        }
+    }
+    memset(dict->counts, 0, dict->count * sizeof(*dict->counts));
+    MOBI_RET ret = MOBI_SUCCESS;
+    uint32_t matches[MOBI_HUFF_SYMBOL_MAX];
+    for (size_t start = 0; start < length && ret == MOBI_SUCCESS; start += record_size) {
+        const size_t end = (length - start < record_size) ? length : start + record_size;
+        if (choice) {
+            mobi_huffdict_parse(dict, text + start, end - start, cost, choice);
+        }
+        size_t previous = SIZE_MAX;
+        size_t pos = start;
+        while (pos < end) {
+            uint32_t index;
+            if (choice) {
+                index = choice[pos - start];
+            } else {
+                const size_t found = mobi_huffdict_matches(dict, text + pos, end - pos, matches);
+                index = matches[found - 1];
+            }
+            dict->counts[index]++;
+            const size_t pair_length = (previous == SIZE_MAX) ? 0 : pos - previous + dict->lengths[index];
+            if (pairs && pair_length && pair_length <= MOBI_HUFF_SYMBOL_MAX) {
+                const unsigned char *pair = text + previous;
+                const uint32_t hash = mobi_huffdict_hash(pair, pair_length);
+                if (mobi_huffdict_find(dict, pair, pair_length, hash) == SIZE_MAX) {
+                    const size_t pair_index = mobi_huffdict_find(pairs, pair, pair_length, hash);
+                    if (pair_index != SIZE_MAX) {
+                        pairs->counts[pair_index]++;
+                    } else if (pairs->count < MOBI_HUFF_CANDIDATES_MAX) {
+                        ret = mobi_huffdict_add(pairs, pair, pair_length, 1);
+                        if (ret != MOBI_SUCCESS) {
+                            break;
+                        }
+                    }
+                }
+            }
+            previous = pos;
+            pos += dict->lengths[index];
+        }
+    }
+    free(cost);
+    free(choice);
+    return ret;
+}
+
+/**
+ @brief Candidate symbol for huffman dictionary, used for sorting
+ */
+typedef struct {
+    uint32_t count; /**< Number of occurrences */
+    uint32_t index; /**< Index in candidates table */
+} MOBIHuffCandidate;
+
+/**
+ @brief Compare candidates by count descending, then by index for stable order
+ 
+ @param[in] a First MOBIHuffCandidate
+ @param[in] b Second MOBIHuffCandidate
+ @return Comparison result for qsort
+ */
+static int mobi_huffdict_compare_candidates(const void *a, const void *b) {
+    const MOBIHuffCandidate *first = a;
+    const MOBIHuffCandidate *second = b;
+    if (first->count != second->count) {
+        return (first->count > second->count) ? -1 : 1;
+    }
+    return (first->index < second->index) ? -1 : (first->index > second->index);
+}
+
+/**
+ @brief Add most frequent candidates worth adding to huffman dictionary
+ 
+ @param[in,out] dict MOBIHuffDict structure
+ @param[in] candidates MOBIHuffDict structure with counted candidates
+ @param[out] added Number of symbols added
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffdict_select(MOBIHuffDict *dict, const MOBIHuffDict *candidates, size_t *added) {
+    *added = 0;
+    if (candidates->count == 0) {
+        return MOBI_SUCCESS;
+    }
+    MOBIHuffCandidate *selected = malloc(candidates->count * sizeof(*selected));
+    if (selected == NULL) {
+        debug_print("%s", "Memory allocation for huffman candidates failed\n");
         return MOBI_MALLOC_FAILED;
     }
-    /* FIXME: is it ok to cast const to non-const here */
-    /* or is there a better way? */
-    buf_in->data = (unsigned char *) in;
-    buf_out->data = out;
-    MOBI_RET ret = mobi_decompress_huffman_internal(buf_out, buf_in, huffcdic, 0);
-    *len_out = buf_out->offset;
-    buffer_free_null(buf_out);
-    buffer_free_null(buf_in);
+    size_t selected_count = 0;
+    for (size_t i = 0; i < candidates->count; i++) {
+        if (mobi_huffdict_worth(candidates->counts[i], candidates->lengths[i])) {
+            selected[selected_count].count = candidates->counts[i];
+            selected[selected_count].index = (uint32_t) i;
+            selected_count++;
+        }
+    }
+    qsort(selected, selected_count, sizeof(*selected), mobi_huffdict_compare_candidates);
+    MOBI_RET ret = MOBI_SUCCESS;
+    for (size_t i = 0; i < selected_count && dict->count < MOBI_HUFF_SYMBOLS_MAX; i++) {
+        const size_t index = selected[i].index;
+        const unsigned char *data = candidates->symbols[index];
+        const size_t length = candidates->lengths[index];
+        if (mobi_huffdict_find(dict, data, length, mobi_huffdict_hash(data, length)) != SIZE_MAX) {
+            continue;
+        }
+        ret = mobi_huffdict_add(dict, data, length, selected[i].count);
+        if (ret != MOBI_SUCCESS) {
+            break;
+        }
+        (*added)++;
+    }
+    free(selected);
     return ret;
 }
+
+/**
+ @brief Count words in text as initial candidates for huffman dictionary
+ 
+ Word is a run of alphanumeric or non-ascii bytes, optionally preceded by a space.
+ 
+ @param[in,out] candidates MOBIHuffDict structure to count words
+ @param[in] text Text
+ @param[in] length Length of the text
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffdict_count_words(MOBIHuffDict *candidates, const unsigned char *text, const size_t length) {
+    size_t pos = 0;
+    while (pos < length) {
+        const size_t start = pos;
+        if (text[pos] == ' ' && pos + 1 < length && mobi_huffdict_is_word(text[pos + 1])) {
+            pos++;
+        } else if (!mobi_huffdict_is_word(text[pos])) {
+            pos++;
+            continue;
+        }
+        while (pos < length && mobi_huffdict_is_word(text[pos])) {
+            pos++;
+        }
+        const size_t word_length = pos - start;
+        if (word_length < 2 || word_length > MOBI_HUFF_SYMBOL_MAX) {
+            continue;
+        }
+        const unsigned char *word = text + start;
+        const size_t index = mobi_huffdict_find(candidates, word, word_length, mobi_huffdict_hash(word, word_length));
+        if (index != SIZE_MAX) {
+            candidates->counts[index]++;
+        } else if (candidates->count < MOBI_HUFF_CANDIDATES_MAX) {
+            const MOBI_RET ret = mobi_huffdict_add(candidates, word, word_length, 1);
+            if (ret != MOBI_SUCCESS) {
+                return ret;
+            }
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Helper structure for building huffman tree, used for sorting leaves
+ */
+typedef struct {
+    uint64_t weight; /**< Weight of the leaf */
+    uint32_t index; /**< Index of the symbol */
+} MOBIHuffLeaf;
+
+/**
+ @brief Compare huffman tree leaves by weight ascending, then by index for stable order
+ 
+ @param[in] a First MOBIHuffLeaf
+ @param[in] b Second MOBIHuffLeaf
+ @return Comparison result for qsort
+ */
+static int mobi_huffdict_compare_leaves(const void *a, const void *b) {
+    const MOBIHuffLeaf *first = a;
+    const MOBIHuffLeaf *second = b;
+    if (first->weight != second->weight) {
+        return (first->weight < second->weight) ? -1 : 1;
+    }
+    return (first->index < second->index) ? -1 : (first->index > second->index);
+}
+
+/**
+ @brief Compute huffman code lengths of dictionary symbols from their counts
+ 
+ Every symbol gets a code, even if it was not counted.
+ If the longest code exceeds MOBI_HUFF_CODE_MAX, counts are scaled down and the tree is rebuilt.
+ 
+ @param[in,out] dict MOBIHuffDict structure with at least two symbols
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffdict_code_lengths(MOBIHuffDict *dict) {
+    const size_t n = dict->count;
+    const size_t nodes_count = 2 * n - 1;
+    uint8_t *code_lengths = realloc(dict->code_lengths, n * sizeof(*code_lengths));
+    if (code_lengths == NULL) {
+        debug_print("%s", "Memory allocation for huffman codes failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    dict->code_lengths = code_lengths;
+    MOBIHuffLeaf *leaves = malloc(n * sizeof(*leaves));
+    uint64_t *weights = malloc(nodes_count * sizeof(*weights));
+    uint32_t *parents = malloc(nodes_count * sizeof(*parents));
+    uint32_t *depths = malloc(nodes_count * sizeof(*depths));
+    if (leaves == NULL || weights == NULL || parents == NULL || depths == NULL) {
+        debug_print("%s", "Memory allocation for huffman tree failed\n");
+        free(leaves);
+        free(weights);
+        free(parents);
+        free(depths);
+        return MOBI_MALLOC_FAILED;
+    }
+    unsigned int shift = 0;
+    uint32_t max_depth;
+    do {
+        for (size_t i = 0; i < n; i++) {
+            weights[i] = (dict->counts[i] >> shift) + 1;
+            leaves[i].weight = weights[i];
+            leaves[i].index = (uint32_t) i;
+        }
+        qsort(leaves, n, sizeof(*leaves), mobi_huffdict_compare_leaves);
+        /* two queues: sorted leaves and internal nodes, which are created with nondecreasing weights */
+        size_t leaf = 0;
+        size_t node = n;
+        for (size_t next = n; next < nodes_count; next++) {
+            size_t picked[2];
+            for (size_t k = 0; k < 2; k++) {
+                if (leaf < n && (node == next || leaves[leaf].weight <= weights[node])) {
+                    picked[k] = leaves[leaf++].index;
+                } else {
+                    picked[k] = node++;
+                }
+            }
+            weights[next] = weights[picked[0]] + weights[picked[1]];
+            parents[picked[0]] = parents[picked[1]] = (uint32_t) next;
+        }
+        /* parent always follows its children */
+        depths[nodes_count - 1] = 0;
+        max_depth = 0;
+        for (size_t i = nodes_count - 1; i-- > 0; ) {
+            depths[i] = depths[parents[i]] + 1;
+            if (i < n && depths[i] > max_depth) {
+                max_depth = depths[i];
+            }
+        }
+        shift++;
+    } while (max_depth > MOBI_HUFF_CODE_MAX);
+    for (size_t i = 0; i < n; i++) {
+        dict->code_lengths[i] = (uint8_t) depths[i];
+    }
+    free(leaves);
+    free(weights);
+    free(parents);
+    free(depths);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Remove symbols which do not pay for their space in CDIC records
+ 
+ Single byte symbols are always kept, so any text can be encoded.
+ 
+ @param[in,out] dict MOBIHuffDict structure with current counts
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffdict_prune(MOBIHuffDict *dict) {
+    size_t kept = 0;
+    for (size_t i = 0; i < dict->count; i++) {
+        if (dict->lengths[i] == 1 || mobi_huffdict_worth(dict->counts[i], dict->lengths[i])) {
+            dict->symbols[kept] = dict->symbols[i];
+            dict->lengths[kept] = dict->lengths[i];
+            dict->counts[kept] = dict->counts[i];
+            kept++;
+        }
+    }
+    dict->count = kept;
+    free(dict->code_lengths);
+    dict->code_lengths = NULL;
+    return mobi_huffdict_rehash(dict, dict->capacity);
+}
+
+/**
+ @brief Order symbols by code length and assign canonical codes
+ 
+ Decoder finds code length as the first length for which code is not less than mincode,
+ so longer codes get lower values. Within each length codes are assigned from the top,
+ as decoder computes symbol index as maxcode minus code.
+ Single byte symbols guarantee the longest code is at least 8 bits long,
+ so zero bits padding the last byte never decode as a symbol.
+ 
+ @param[in,out] dict MOBIHuffDict structure with computed code lengths
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffdict_assign_codes(MOBIHuffDict *dict) {
+    const size_t n = dict->count;
+    size_t length_count[MOBI_HUFF_CODE_MAX + 2] = { 0 };
+    size_t length_base[MOBI_HUFF_CODE_MAX + 2] = { 0 };
+    for (size_t i = 0; i < n; i++) {
+        length_count[dict->code_lengths[i]]++;
+    }
+    for (size_t length = 1; length <= MOBI_HUFF_CODE_MAX; length++) {
+        length_base[length + 1] = length_base[length] + length_count[length];
+    }
+    const unsigned char **symbols = malloc(n * sizeof(*symbols));
+    uint8_t *lengths = malloc(n * sizeof(*lengths));
+    uint32_t *counts = malloc(n * sizeof(*counts));
+    uint8_t *code_lengths = malloc(n * sizeof(*code_lengths));
+    uint32_t *codes = malloc(n * sizeof(*codes));
+    if (symbols == NULL || lengths == NULL || counts == NULL || code_lengths == NULL || codes == NULL) {
+        debug_print("%s", "Memory allocation for huffman codes failed\n");
+        free(symbols);
+        free(lengths);
+        free(counts);
+        free(code_lengths);
+        free(codes);
+        return MOBI_MALLOC_FAILED;
+    }
+    /* stable counting sort by code length */
+    size_t position[MOBI_HUFF_CODE_MAX + 2];
+    memcpy(position, length_base, sizeof(position));
+    for (size_t i = 0; i < n; i++) {
+        const size_t index = position[dict->code_lengths[i]]++;
+        symbols[index] = dict->symbols[i];
+        lengths[index] = dict->lengths[i];
+        counts[index] = dict->counts[i];
+        code_lengths[index] = dict->code_lengths[i];
+    }
+    free(dict->symbols);
+    free(dict->lengths);
+    free(dict->counts);
+    free(dict->code_lengths);
+    free(dict->codes);
+    dict->symbols = symbols;
+    dict->lengths = lengths;
+    dict->counts = counts;
+    dict->code_lengths = code_lengths;
+    dict->codes = codes;
+    dict->capacity = n;
+    /* first code of each length, starting from the longest */
+    uint32_t start[MOBI_HUFF_CODE_MAX + 2] = { 0 };
+    for (size_t length = MOBI_HUFF_CODE_MAX; length >= 1; length--) {
+        start[length] = (uint32_t) ((start[length + 1] + length_count[length + 1] + 1) >> 1);
+    }
+    memset(dict->table1, 0, sizeof(dict->table1));
+    dict->mincode[0] = 0;
+    dict->maxcode[0] = 0;
+    size_t min_long_length = MOBI_HUFF_CODE_MAX;
+    for (size_t length = 1; length <= MOBI_HUFF_CODE_MAX; length++) {
+        const uint32_t count = (uint32_t) length_count[length];
+        /* index = maxcode - code, indices of this length start at base */
+        const uint32_t maxcode = count ? (uint32_t) length_base[length] + start[length] + count - 1 : 0;
+        dict->mincode[length] = start[length];
+        dict->maxcode[length] = maxcode;
+        for (uint32_t k = 0; k < count; k++) {
+            const uint32_t code = start[length] + count - 1 - k;
+            dict->codes[length_base[length] + k] = code;
+            if (length <= 8) {
+                /* all codes starting with these bytes have this length */
+                const uint32_t first = code << (8 - length);
+                const uint32_t last = (code + 1) << (8 - length);
+                for (uint32_t prefix = first; prefix < last; prefix++) {
+                    dict->table1[prefix] = maxcode << 8 | 0x80 | (uint32_t) length;
+                }
+            }
+        }
+        if (count && length > 8 && length < min_long_length) {
+            min_long_length = length;
+        }
+    }
+    /* remaining bytes start codes longer than 8 bits, decoder searches from the given length */
+    for (size_t prefix = 0; prefix < 256; prefix++) {
+        if (dict->table1[prefix] == 0) {
+            dict->table1[prefix] = (uint32_t) min_long_length;
+        }
+    }
+    return mobi_huffdict_rehash(dict, n);
+}
+
+/**
+ @brief Build huffman dictionary for given text
+ 
+ Dictionary starts with all single bytes and frequent words.
+ In each of MOBI_HUFF_ROUNDS rounds, text is parsed with current symbols
+ and most frequent pairs of adjacent symbols are added as new symbols.
+ Then code lengths are refined with optimal parsing, and symbols not worth their space are removed.
+ 
+ @param[out] dict Built MOBIHuffDict structure, must be freed with mobi_free_huffdict()
+ @param[in] text Text to be compressed, must stay valid while dictionary is used
+ @param[in] length Length of the text
+ @param[in] record_size Size of text records compressed separately
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_build_huffdict(MOBIHuffDict **dict, const unsigned char *text, const size_t length, const size_t record_size) {
+    *dict = NULL;
+    if (record_size == 0) {
+        return MOBI_PARAM_ERR;
+    }
+    MOBIHuffDict *built = mobi_init_huffdict();
+    if (built == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBI_RET ret = MOBI_SUCCESS;
+    for (size_t i = 0; i < 256 && ret == MOBI_SUCCESS; i++) {
+        ret = mobi_huffdict_add(built, &built->bytes[i], 1, 0);
+    }
+    size_t added = 1;
+    for (size_t round = 0; round <= MOBI_HUFF_ROUNDS && added && ret == MOBI_SUCCESS; round++) {
+        MOBIHuffDict *candidates = mobi_init_huffdict();
+        if (candidates == NULL) {
+            ret = MOBI_MALLOC_FAILED;
+            break;
+        }
+        if (round == 0) {
+            ret = mobi_huffdict_count_words(candidates, text, length);
+        } else {
+            ret = mobi_huffdict_count(built, text, length, record_size, candidates);
+        }
+        if (ret == MOBI_SUCCESS) {
+            ret = mobi_huffdict_select(built, candidates, &added);
+        }
+        mobi_free_huffdict(candidates);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_huffdict_count(built, text, length, record_size, NULL);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_huffdict_code_lengths(built);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_huffdict_count(built, text, length, record_size, NULL);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_huffdict_prune(built);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_huffdict_code_lengths(built);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_huffdict_count(built, text, length, record_size, NULL);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_huffdict_code_lengths(built);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_huffdict_assign_codes(built);
+    }
+    if (ret != MOBI_SUCCESS) {
+        mobi_free_huffdict(built);
+        return ret;
+    }
+    *dict = built;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Compressor for huff/cdic compression
+ 
+ Data is encoded with the shortest sequence of dictionary symbols for assigned code lengths.
+ Dictionary may be shared by threads compressing records concurrently.
+ 
+ @param[out] out Compressed destination data
+ @param[in] in Uncompressed source data
+ @param[in,out] len_out Size of the memory reserved for compressed data.
+ On return it is set to actual size of compressed data
+ @param[in] len_in Size of uncompressed data
+ @param[in] dict MOBIHuffDict structure built with mobi_build_huffdict()
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_compress_huffman(unsigned char *out, const unsigned char *in, size_t *len_out, const size_t len_in, const MOBIHuffDict *dict) {
+    if (dict == NULL || dict->codes == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    uint32_t *cost = malloc((len_in + 1) * sizeof(*cost));
+    uint32_t *choice = malloc((len_in ? len_in : 1) * sizeof(*choice));
+    if (cost == NULL || choice == NULL) {
+        debug_print("%s", "Memory allocation for huffman parser failed\n");
+        free(cost);
+        free(choice);
+        return MOBI_MALLOC_FAILED;
+    }
+    mobi_huffdict_parse(dict, in, len_in, cost, choice);
+    const size_t size = (cost[0] + 7) / 8;
+    if (size > *len_out) {
+        free(cost);
+        free(choice);
+        return MOBI_BUFFER_END;
+    }
+    unsigned char *out_ptr = out;
+    /* low bits of accumulator hold pending bits, at most 7 + MOBI_HUFF_CODE_MAX */
+    uint64_t bits = 0;
+    unsigned int bits_count = 0;
+    size_t pos = 0;
+    while (pos < len_in) {
+        const uint32_t index = choice[pos];
+        bits = bits << dict->code_lengths[index] | dict->codes[index];
+        bits_count += dict->code_lengths[index];
+        while (bits_count >= 8) {
+            bits_count -= 8;
+            *out_ptr++ = (unsigned char) (bits >> bits_count);
+        }
+        pos += dict->lengths[index];
+    }
+    if (bits_count) {
+        *out_ptr++ = (unsigned char) (bits << (8 - bits_count));
+    }
+    free(cost);
+    free(choice);
+    *len_out = size;
+    return MOBI_SUCCESS;
+}
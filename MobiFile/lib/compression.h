@@ -20,8 +20,44 @@
 
 /* FIXME: what is the reasonable value? */
 #define MOBI_HUFFMAN_MAXDEPTH 15 /**< Maximal recursion level for huffman decompression routine */
+#define MOBI_LZ77_WINDOW 2047 /**< Maximal distance of PalmDOC LZ77 match, also used as a mask */
+#define MOBI_LZ77_MATCH_MAX 10 /**< Maximal length of PalmDOC LZ77 match */
+#define MOBI_LZ77_HASH_BITS 12 /**< Size of hash table used by PalmDOC compressor */
+#define MOBI_HUFFCDIC_CACHE_SIZE (4 * 1024 * 1024) /**< Default memory limit for cache of expanded huffman symbols */
+#define MOBI_HUFF_SYMBOL_MAX 32 /**< Maximal length of dictionary symbol created by huffman compressor */
+#define MOBI_HUFF_SYMBOLS_MAX 0x10000 /**< Maximal number of dictionary symbols created by huffman compressor */
+#define MOBI_HUFF_CODE_MAX 32 /**< Maximal code length created by huffman compressor */
+#define MOBI_HUFF_CANDIDATES_MAX 0x100000 /**< Maximal number of candidate symbols counted in each round of dictionary building */
+#define MOBI_HUFF_ROUNDS 4 /**< Number of rounds merging pairs of symbols while building dictionary */
+
+/**
+ @brief Dictionary of symbols with their huffman codes, built by huffman compressor
+ 
+ Symbols are ordered by code length, position in the array is the index stored in CDIC records.
+ Same structure is used to count candidate symbols while building dictionary.
+ */
+typedef struct {
+    const unsigned char **symbols; /**< Symbol data, pointing into source text or into bytes table */
+    uint8_t *lengths; /**< Length of each symbol */
+    uint32_t *counts; /**< Number of occurrences of each symbol in parsed text */
+    uint8_t *code_lengths; /**< Code length of each symbol, or NULL if codes are not assigned yet */
+    uint32_t *codes; /**< Code of each symbol, or NULL if codes are not assigned yet */
+    size_t count; /**< Number of symbols */
+    size_t capacity; /**< Number of symbols allocated */
+    uint32_t *slots; /**< Hash table of symbol indices increased by one, zero for empty slot */
+    size_t slots_mask; /**< Number of hash table slots minus one */
+    uint8_t *max_length; /**< Length of the longest symbol for each 2-byte prefix (65536 entries) */
+    uint32_t table1[256]; /**< HUFF data1 entries */
+    uint32_t mincode[33]; /**< HUFF data2 mincodes, not shifted */
+    uint32_t maxcode[33]; /**< HUFF data2 maxcodes, not shifted */
+    unsigned char bytes[256]; /**< Data of single byte symbols */
+} MOBIHuffDict;
 
 MOBI_RET mobi_decompress_lz77(unsigned char *out, const unsigned char *in, size_t *len_out, const size_t len_in);
+MOBI_RET mobi_compress_lz77(unsigned char *out, const unsigned char *in, size_t *len_out, const size_t len_in, const int level);
 MOBI_RET mobi_decompress_huffman(unsigned char *out, const unsigned char *in, size_t *len_out, size_t len_in, const MOBIHuffCdic *huffcdic);
+MOBI_RET mobi_build_huffdict(MOBIHuffDict **dict, const unsigned char *text, const size_t length, const size_t record_size);
+MOBI_RET mobi_compress_huffman(unsigned char *out, const unsigned char *in, size_t *len_out, const size_t len_in, const MOBIHuffDict *dict);
+void mobi_free_huffdict(MOBIHuffDict *dict);
 
 #endif
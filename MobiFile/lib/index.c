@@ -215,18 +215,18 @@ static MOBI_RET mobi_parse_index_entry(MOBIIndx *indx, const MOBIIdxt idxt, cons
  */
 MOBI_RET mobi_parse_indx(const MOBIPdbRecord *indx_record, MOBIIndx *indx, MOBITagx *tagx) {
     MOBI_RET ret;
-    MOBIBuffer *buf = buffer_init_null(indx_record->size);
-    if (buf == NULL) {
-        return MOBI_MALLOC_FAILED;
+    if (indx_record == NULL) {
+        debug_print("%s", "INDX record not found\n");
+        return MOBI_DATA_CORRUPT;
     }
-    buf->data = indx_record->data;
+    MOBIBuffer buf_view;
+    MOBIBuffer *buf = buffer_init_view(&buf_view, indx_record->data, indx_record->size);
     char indx_magic[5];
     buffer_getstring(indx_magic, buf, 4); /* 0: INDX magic */
     const uint32_t header_length = buffer_get32(buf); /* 4: header length */
     if (strncmp(indx_magic, INDX_MAGIC, 4) != 0 ||
         header_length == 0) {
         debug_print("INDX wrong magic: %s or header length: %u\n", indx_magic, header_length);
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     buf->offset += 4; /* 8: zeroes */
@@ -262,14 +262,12 @@ MOBI_RET mobi_parse_indx(const MOBIPdbRecord *indx_record, MOBIIndx *indx, MOBIT
     /* if record contains TAGX section, read it and return */
     if (buffer_match_magic(buf, TAGX_MAGIC)) {
         ret = mobi_parse_tagx(buf, tagx);
-        buffer_free_null(buf);
         indx->entries_count = entries_count;
         return ret;
     }
     /* IDXT entries offsets */
     if (idxt_offset == 0) {
         debug_print("%s", "Missing IDXT offset\n");
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     buf->offset = idxt_offset;
@@ -279,7 +277,6 @@ MOBI_RET mobi_parse_indx(const MOBIPdbRecord *indx_record, MOBIIndx *indx, MOBIT
     ret = mobi_parse_idxt(buf, &idxt, entries_count);
     if (ret != MOBI_SUCCESS) {
         debug_print("%s", "IDXT parsing failed\n");
-        buffer_free_null(buf);
         return ret;
     }
     /* parse entries */
@@ -287,7 +284,6 @@ MOBI_RET mobi_parse_indx(const MOBIPdbRecord *indx_record, MOBIIndx *indx, MOBIT
         if (indx->entries == NULL) {
             indx->entries = malloc(indx->total_entries_count * sizeof(MOBIIndexEntry));
             if (indx->entries == NULL) {
-                buffer_free_null(buf);
                 return MOBI_MALLOC_FAILED;
             }
         }
@@ -295,14 +291,12 @@ MOBI_RET mobi_parse_indx(const MOBIPdbRecord *indx_record, MOBIIndx *indx, MOBIT
         while (i < entries_count) {
             ret = mobi_parse_index_entry(indx, idxt, *tagx, buf, i++);
             if (ret != MOBI_SUCCESS) {
-                buffer_free_null(buf);
                 return ret;
             }
         }
         indx->entries_count += entries_count;
 
     }
-    buffer_free_null(buf);
     return MOBI_SUCCESS;
 }
 
@@ -332,7 +326,7 @@ MOBI_RET mobi_parse_index(const MOBIData *m, MOBIIndx *indx, const size_t indx_r
     size_t count = indx->entries_count;
     indx->entries_count = 0;
     while (count--) {
-        record = record->next;
+        record = mobi_get_next_record(m, record);
         ret = mobi_parse_indx(record, indx, &tagx);
         if (ret != MOBI_SUCCESS) {
             mobi_free_indx(indx);
@@ -344,7 +338,7 @@ MOBI_RET mobi_parse_index(const MOBIData *m, MOBIIndx *indx, const size_t indx_r
     /* copy pointer to first cncx record if present and set info from first record */
     if (cncx_count) {
         indx->cncx_records_count = cncx_count;
-        indx->cncx_record = record->next;
+        indx->cncx_record = mobi_get_next_record(m, record);
     }
     free(tagx.tags);
     return MOBI_SUCCESS;
@@ -388,15 +382,14 @@ MOBI_RET mobi_get_indxentry_tagvalue(uint32_t *tagvalue, const MOBIIndexEntry *e
  */
 char * mobi_get_cncx_string(const MOBIPdbRecord *cncx_record, const uint32_t cncx_offset) {
     /* TODO: handle multiple cncx records */
-    MOBIBuffer *buf = buffer_init_null(cncx_record->size);
-    buf->data = cncx_record->data;
+    MOBIBuffer buf_view;
+    MOBIBuffer *buf = buffer_init_view(&buf_view, cncx_record->data, cncx_record->size);
     buf->offset = cncx_offset;
     size_t len = 0;
     const uint32_t string_length = buffer_get_varlen(buf, &len);
     char *string = malloc(string_length + 1);
     if (string) {
         buffer_getstring(string, buf, string_length);
-        buffer_free_null(buf);
     }
     return string;
 }
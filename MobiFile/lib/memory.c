@@ -10,6 +10,10 @@
  */
 
 #include <stdlib.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 #include "memory.h"
 #include "debug.h"
 #include "util.h"
@@ -27,12 +31,24 @@ MOBIData * mobi_init(void) {
     m = calloc(1, sizeof(MOBIData));
 	if (m == NULL) return NULL;
     m->use_kf8 = true;
+    m->use_lazy = false;
+    m->threads = 1;
+    m->huff_cache_size = MOBI_HUFFCDIC_CACHE_SIZE;
     m->kf8_boundary_offset = MOBI_NOTSET;
     m->ph = NULL;
     m->rh = NULL;
     m->mh = NULL;
     m->eh = NULL;
     m->rec = NULL;
+    m->rec_index = NULL;
+    m->huffcdic = NULL;
+    m->text_offsets = NULL;
+    m->trailing = NULL;
+    m->record_cache = NULL;
+    m->storage = MOBI_STORAGE_HEAP;
+    m->file_data = NULL;
+    m->file_size = 0;
+    m->fd = -1;
     m->next = NULL;
     return m;
 }
@@ -111,10 +127,21 @@ void mobi_free_mh(MOBIMobiHeader *mh) {
     mh = NULL;
 }
 
+/**
+ @brief Check if records data is allocated separately for each record and owned by MOBIData structure
+ 
+ @param[in] m MOBIData structure
+ @return True if records data must be freed with the records, false if it points into document data
+ */
+bool mobi_is_recdata_owned(const MOBIData *m) {
+    return (m->storage == MOBI_STORAGE_HEAP || m->storage == MOBI_STORAGE_LAZY);
+}
+
 /**
  @brief Free all MOBIPdbRecord structures and its respective data attached to MOBIData structure
  
- Each MOBIPdbRecord structure holds metadata and data for each pdb record
+ Each MOBIPdbRecord structure holds metadata and data for each pdb record.
+ Records data pointing into memory mapped file is not freed, see mobi_free_filedata().
  
  @param[in,out] m MOBIData structure
  */
@@ -124,11 +151,65 @@ void mobi_free_rec(MOBIData *m) {
     while (curr != NULL) {
         tmp = curr;
         curr = curr->next;
-        free(tmp->data);
+        if (mobi_is_recdata_owned(m)) {
+            free(tmp->data);
+        }
         free(tmp);
         tmp = NULL;
     }
     m->rec = NULL;
+    mobi_free_record_index(m);
+}
+
+/**
+ @brief Free linked list of records created outside of MOBIData structure, together with their data
+ 
+ @param[in] records First record of the list
+ */
+void mobi_free_records(MOBIPdbRecord *records) {
+    while (records != NULL) {
+        MOBIPdbRecord *next = records->next;
+        free(records->data);
+        free(records);
+        records = next;
+    }
+}
+
+/**
+ @brief Free lookup tables of records
+ 
+ @param[in,out] m MOBIData structure
+ */
+void mobi_free_record_index(MOBIData *m) {
+    if (m->rec_index == NULL) {
+        return;
+    }
+    free(m->rec_index->records);
+    free(m->rec_index->uid_map);
+    free(m->rec_index);
+    m->rec_index = NULL;
+}
+
+/**
+ @brief Release source of the records data: memory area holding whole document data or file descriptor
+ 
+ @param[in,out] m MOBIData structure
+ */
+void mobi_free_filedata(MOBIData *m) {
+#ifndef _WIN32
+    if (m->fd != -1) {
+        close(m->fd);
+        m->fd = -1;
+    }
+    if (m->file_data && m->storage == MOBI_STORAGE_MMAP) {
+        munmap(m->file_data, m->file_size);
+    }
+#endif
+    if (m->storage == MOBI_STORAGE_BUFFER_OWNED) {
+        free(m->file_data);
+    }
+    m->file_data = NULL;
+    m->file_size = 0;
 }
 
 /**
@@ -162,12 +243,20 @@ void mobi_free(MOBIData *m) {
     }
     mobi_free_mh(m->mh);
     mobi_free_eh(m);
+    mobi_free_huffcdic(m->huffcdic);
+    free(m->text_offsets);
+    free(m->trailing);
+    mobi_free_record_cache(m->record_cache);
     mobi_free_rec(m);
+    mobi_free_filedata(m);
     free(m->ph);
     free(m->rh);
     if (m->next) {
         mobi_free_mh(m->next->mh);
         mobi_free_eh(m->next);
+        mobi_free_huffcdic(m->next->huffcdic);
+        free(m->next->text_offsets);
+        free(m->next->trailing);
         free(m->next->rh);
         free(m->next);
         m->next = NULL;
@@ -176,6 +265,91 @@ void mobi_free(MOBIData *m) {
     m = NULL;
 }
 
+/**
+ @brief Free strings held by MOBIProbe structure
+ 
+ Structure itself is not freed, it is usually allocated by the caller on the stack.
+ 
+ @param[in,out] probe MOBIProbe structure
+ */
+void mobi_free_probe(MOBIProbe *probe) {
+    if (probe == NULL) {
+        return;
+    }
+    free(probe->title);
+    free(probe->author);
+    free(probe->language);
+    probe->title = NULL;
+    probe->author = NULL;
+    probe->language = NULL;
+}
+
+/**
+ @brief Initialize and return MOBIRecordCache structure.
+ 
+ It must be freed with mobi_free_record_cache().
+ 
+ @param[in] limit Maximal total size of cached data
+ @return MOBIRecordCache on success, NULL otherwise
+ */
+MOBIRecordCache * mobi_init_record_cache(const size_t limit) {
+    MOBIRecordCache *cache = calloc(1, sizeof(MOBIRecordCache));
+    if (cache == NULL) {
+        debug_print("%s", "Memory allocation for record cache failed\n");
+        return NULL;
+    }
+#ifndef _WIN32
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        debug_print("%s", "Record cache mutex initialization failed\n");
+        free(cache);
+        return NULL;
+    }
+#endif
+    cache->limit = limit;
+    return cache;
+}
+
+/**
+ @brief Remove all entries from MOBIRecordCache structure
+ 
+ Hit and miss counters are preserved.
+ 
+ @param[in,out] cache MOBIRecordCache structure
+ */
+void mobi_clear_record_cache(MOBIRecordCache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    MOBIRecordCacheEntry *curr = cache->head;
+    while (curr) {
+        MOBIRecordCacheEntry *next = curr->next;
+        free(curr);
+        curr = next;
+    }
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->entries_count = 0;
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->size = 0;
+}
+
+/**
+ @brief Free MOBIRecordCache structure and all its entries
+ 
+ @param[in] cache MOBIRecordCache structure
+ */
+void mobi_free_record_cache(MOBIRecordCache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    mobi_clear_record_cache(cache);
+#ifndef _WIN32
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    free(cache);
+}
+
 /**
  @brief Initialize and return MOBIHuffCdic structure.
  
@@ -195,6 +369,47 @@ MOBIHuffCdic * mobi_init_huffcdic(void) {
     return huffcdic;
 }
 
+/**
+ @brief Initialize and return MOBIHuffCache structure.
+ 
+ Arena memory for expanded symbols is limited to given size.
+ It must be freed with mobi_free_huffcache().
+ 
+ @param[in] index_count Number of symbols in CDIC records
+ @param[in] size Size of the arena for expanded symbols
+ @return MOBIHuffCache on success, NULL otherwise
+ */
+MOBIHuffCache * mobi_init_huffcache(const size_t index_count, const size_t size) {
+    MOBIHuffCache *cache = calloc(1, sizeof(MOBIHuffCache));
+    if (cache == NULL) {
+        debug_print("%s", "Memory allocation for huffman cache failed\n");
+        return NULL;
+    }
+    cache->entries = calloc(index_count, sizeof(*cache->entries));
+    cache->data = malloc(size);
+    if (cache->entries == NULL || cache->data == NULL) {
+        debug_print("%s", "Memory allocation for huffman cache failed\n");
+        mobi_free_huffcache(cache);
+        return NULL;
+    }
+    cache->size = size;
+    return cache;
+}
+
+/**
+ @brief Free MOBIHuffCache structure and all its children
+ 
+ @param[in] cache MOBIHuffCache structure
+ */
+void mobi_free_huffcache(MOBIHuffCache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    free(cache->entries);
+    free(cache->data);
+    free(cache);
+}
+
 /**
  @brief Free MOBIHuffCdic structure and all its children
  
@@ -204,8 +419,10 @@ void mobi_free_huffcdic(MOBIHuffCdic *huffcdic) {
     if (huffcdic == NULL) {
         return;
     }
+    free(huffcdic->table2);
     free(huffcdic->symbol_offsets);
     free(huffcdic->symbols);
+    mobi_free_huffcache(huffcdic->cache);
     free(huffcdic);
     huffcdic = NULL;
 }
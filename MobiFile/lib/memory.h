@@ -13,15 +13,60 @@
 
 #include "config.h"
 #include "mobi.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+/**
+ @brief Decompressed text record held in MOBIRecordCache
+ */
+typedef struct MOBIRecordCacheEntry {
+    size_t seqnumber; /**< Sequential number of the record */
+    size_t size; /**< Size of decompressed data */
+    unsigned char *data; /**< Decompressed data, allocated together with the entry */
+    struct MOBIRecordCacheEntry *prev; /**< More recently used entry or NULL */
+    struct MOBIRecordCacheEntry *next; /**< Less recently used entry or NULL */
+} MOBIRecordCacheEntry;
+
+/**
+ @brief Size-bounded LRU cache of decompressed text records, keyed by record sequential number
+ 
+ Cache is guarded by a mutex, so it may be used by concurrent readers.
+ Without pthreads a spin lock is used instead.
+ */
+struct MOBIRecordCache {
+    MOBIRecordCacheEntry **entries; /**< Entries indexed by record sequential number, NULL if record is not cached */
+    size_t entries_count; /**< Number of slots in entries array */
+    MOBIRecordCacheEntry *head; /**< Most recently used entry or NULL */
+    MOBIRecordCacheEntry *tail; /**< Least recently used entry or NULL */
+    size_t size; /**< Total size of cached data */
+    size_t limit; /**< Maximal total size of cached data */
+    size_t hits; /**< Number of lookups that found the record */
+    size_t misses; /**< Number of lookups that did not find the record */
+#ifndef _WIN32
+    pthread_mutex_t lock; /**< Mutex guarding all fields */
+#else
+    bool lock; /**< Spin lock, taken with atomic builtins */
+#endif
+};
 
 MOBIData * mobi_init(void);
 void mobi_free_mh(MOBIMobiHeader *mh);
+bool mobi_is_recdata_owned(const MOBIData *m);
 void mobi_free_rec(MOBIData *m);
+void mobi_free_records(MOBIPdbRecord *records);
+void mobi_free_record_index(MOBIData *m);
+void mobi_free_filedata(MOBIData *m);
 void mobi_free_eh(MOBIData *m);
 void mobi_free(MOBIData *m);
 
 MOBIHuffCdic * mobi_init_huffcdic(void);
 void mobi_free_huffcdic(MOBIHuffCdic *huffcdic);
+MOBIHuffCache * mobi_init_huffcache(const size_t index_count, const size_t size);
+void mobi_free_huffcache(MOBIHuffCache *cache);
+MOBIRecordCache * mobi_init_record_cache(const size_t limit);
+void mobi_clear_record_cache(MOBIRecordCache *cache);
+void mobi_free_record_cache(MOBIRecordCache *cache);
 
 MOBIIndx * mobi_init_indx(void);
 void mobi_free_indx(MOBIIndx *indx);
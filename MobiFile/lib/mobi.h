@@ -184,6 +184,34 @@ extern "C"
         char mime_type[30]; /**< mime-type */
     } MOBIFileMeta;
     
+    /**
+     @brief Storage of the records data
+     */
+    typedef enum {
+        MOBI_STORAGE_HEAP = 0, /**< Data of each record is read into separately allocated memory (default) */
+        MOBI_STORAGE_MMAP, /**< Records data points into read-only memory mapped file */
+        MOBI_STORAGE_LAZY, /**< Data of each record is read from file on first access into separately allocated memory */
+        MOBI_STORAGE_BUFFER, /**< Records data points into memory buffer owned by the caller */
+        MOBI_STORAGE_BUFFER_OWNED, /**< Records data points into memory buffer released with free() by mobi_free() */
+    } MOBIStorage;
+    
+    /**
+     @brief Flags for mobi_load_buffer()
+     */
+    typedef enum {
+        MOBI_BUFFER_BORROW = 0, /**< Buffer is not copied and must stay valid until mobi_free() is called (default) */
+        MOBI_BUFFER_TAKE = 1, /**< Buffer allocated with malloc() is owned by MOBIData structure and released with mobi_free() */
+    } MOBIBufferFlags;
+    
+    /**
+     @brief PalmDOC compression levels for mobi_compress_palmdoc()
+     */
+    typedef enum {
+        MOBI_LZ77_LEVEL_FASTEST = 0, /**< No matches, only space + char pairs */
+        MOBI_LZ77_LEVEL_DEFAULT = 6, /**< Good ratio at reasonable speed */
+        MOBI_LZ77_LEVEL_MAX = 9, /**< Best ratio */
+    } MOBILZ77Level;
+    
     /** @} */
     
     /**
@@ -191,6 +219,18 @@ extern "C"
      @{
      */
     
+    /**
+     @brief Cache of expanded compressed HUFF/CDIC symbols
+     
+     Entries are filled on first use and never evicted, memory is bounded by the arena size.
+     */
+    typedef struct {
+        unsigned char **entries; /**< Expanded symbols indexed like symbol_offsets, each preceded by its 4-byte length, NULL if not cached */
+        unsigned char *data; /**< Arena holding expanded symbols */
+        size_t size; /**< Size of the arena */
+        size_t used; /**< Bytes of the arena in use */
+    } MOBIHuffCache;
+    
     /**
      @brief Parsed data from HUFF and CDIC records needed to unpack huffman compressed text
      */
@@ -201,8 +241,10 @@ extern "C"
         uint32_t table1[256]; /**< Table of big-endian indices from HUFF record data1 */
         uint32_t mincode_table[33]; /**< Table of big-endian mincodes from HUFF record data2 */
         uint32_t maxcode_table[33]; /**< Table of big-endian maxcodes from HUFF record data2 */
+        uint8_t *table2; /**< Second-level table of code lengths indexed by 16-bit code prefix, used when table1 entry is not terminal (65536 entries) or NULL */
         uint16_t *symbol_offsets; /**< Index of symbol offsets parsed from CDIC records (index_count entries) */
         unsigned char **symbols; /**< Array of pointers to start of symbols data in each CDIC record (index = number of CDIC record) */
+        MOBIHuffCache *cache; /**< Cache of expanded compressed symbols or NULL if disabled */
     } MOBIHuffCdic;
 
     /**
@@ -236,6 +278,32 @@ extern "C"
         unsigned char *data; /**< Record data */
         struct MOBIPdbRecord *next; /**< Pointer to the next record or NULL */
     } MOBIPdbRecord;
+    
+    /**
+     @brief Trailing entries at the end of text record, parsed from extra data described by extra flags in MOBI header
+     */
+    typedef struct {
+        uint32_t text_size; /**< Size of record data without trailing entries, 0 if trailing entries are corrupt */
+        uint32_t tbs_offset; /**< Offset of TBS indexing data (extra flags bit 1) in record data */
+        uint32_t tbs_size; /**< Size of TBS indexing data without its size field, 0 if not present */
+        uint8_t multibyte_size; /**< Number of bytes of multibyte character continued in the next record (extra flags bit 0) */
+        uint8_t multibyte[3]; /**< Bytes of multibyte character continued in the next record */
+    } MOBITrailingEntries;
+
+    /**
+     @brief Lookup tables of records built once after loading, shared by both parts of hybrid file
+     */
+    typedef struct {
+        MOBIPdbRecord **records; /**< Array of records in sequential order */
+        size_t count; /**< Number of records in the array */
+        MOBIPdbRecord **uid_map; /**< Hash map of records by uid, open addressing with linear probing */
+        size_t uid_map_size; /**< Number of slots in uid_map, power of two */
+    } MOBIRecordIndex;
+    
+    /**
+     @brief Size-bounded LRU cache of decompressed text records, opaque structure
+     */
+    typedef struct MOBIRecordCache MOBIRecordCache;
 
     /**
      @brief Metadata and data of a EXTH record. All records form a linked list.
@@ -359,15 +427,69 @@ extern "C"
      */
     typedef struct MOBIData {
         bool use_kf8; /**< Flag: if set to true (default), KF8 part of hybrid file is parsed, if false - KF7 part will be parsed */
+        bool use_lazy; /**< Flag: if set to true, records data is read from file on first access, if false (default) - all records are read on load */
+        size_t threads; /**< Number of threads used for text records decompression, 1 (default) - no additional threads */
+        size_t huff_cache_size; /**< Memory limit for cache of expanded HUFF/CDIC symbols, 0 - cache disabled */
         uint32_t kf8_boundary_offset; /**< Set to KF8 boundary rec number if present, otherwise: MOBI_NOTSET */
         MOBIPdbHeader *ph; /**< Palmdoc database header structure or NULL if not loaded */
         MOBIRecord0Header *rh; /**< Record0 header structure or NULL if not loaded */
         MOBIMobiHeader *mh; /**< MOBI header structure or NULL if not loaded */
         MOBIExthHeader *eh; /**< Linked list of EXTH records or NULL if not loaded */
         MOBIPdbRecord *rec; /**< Linked list of palmdoc database records or NULL if not loaded */
+        MOBIRecordIndex *rec_index; /**< Lookup tables of records or NULL if not built */
+        MOBIHuffCdic *huffcdic; /**< Parsed HUFF/CDIC tables of this part, kept after first huffman decompression, or NULL */
+        MOBIRecordCache *record_cache; /**< Cache of decompressed text records, NULL if disabled (default) */
+        size_t *text_offsets; /**< Offsets of text records in decompressed text of this part (text_record_count + 1 entries), kept after first mobi_get_text_range() call, or NULL */
+        MOBITrailingEntries *trailing; /**< Trailing entries of text records of this part (text_record_count entries), kept after first decompression if extra flags are set, or NULL */
+        MOBIStorage storage; /**< Storage of the records data, MOBI_STORAGE_HEAP by default */
+        unsigned char *file_data; /**< Whole document data, if records data points into it, otherwise NULL */
+        size_t file_size; /**< Size of the document data in file_data */
+        int fd; /**< File descriptor used to read records data on demand in lazy mode, otherwise -1 */
         struct MOBIData *next; /**< Pointer to the other part of hybrid file or NULL if not a hybrid file */
     } MOBIData;
     
+    /**
+     @brief Function called by mobi_load_stream() for each record as soon as its data is read
+     
+     @param[in] record Record with loaded data
+     @param[in] seqnumber Sequential number of the record
+     @param[in,out] context Pointer passed to mobi_load_stream()
+     @return MOBI_RET status code, loading is stopped if other than MOBI_SUCCESS
+     */
+    typedef MOBI_RET (*MOBIRecordCallback)(const MOBIPdbRecord *record, const size_t seqnumber, void *context);
+    
+    /**
+     @brief Flags for mobi_text_reader_open()
+     */
+    typedef enum {
+        MOBI_TEXT_RAW = 0, /**< Text is returned in document encoding (default) */
+        MOBI_TEXT_UTF8 = 1, /**< Text of cp1252 encoded documents is converted to utf-8 */
+        MOBI_TEXT_VALIDATE = 2, /**< Text of utf-8 encoded documents is validated, malformed text stops reading with MOBI_DATA_CORRUPT */
+        MOBI_TEXT_REPAIR = 4, /**< Malformed sequences in text of utf-8 encoded documents are replaced with U+FFFD */
+    } MOBITextFlags;
+    
+    /**
+     @brief Reader returning decompressed text one record at a time
+     
+     Memory used by the reader does not depend on the document size.
+     Initialized with mobi_text_reader_open(), released with mobi_text_reader_close().
+     */
+    typedef struct {
+        const MOBIData *m; /**< Document being read */
+        const MOBIHuffCdic *huffcdic; /**< Parsed huff/cdic tables or NULL */
+        const MOBIPdbRecord *record; /**< Next text record or NULL if all records were read */
+        size_t remaining; /**< Number of text records left */
+        uint16_t compression_type; /**< Compression type from Record 0 header */
+        const MOBITrailingEntries *trailing; /**< Parsed trailing entries of text records or NULL if records have none */
+        bool convert; /**< Flag: if true, cp1252 text is converted to utf-8 */
+        unsigned char *data; /**< Output area for decompressed text of the current record */
+        char *text; /**< Current record converted to utf-8, NULL if conversion is not needed */
+        int check; /**< MOBI_TEXT_VALIDATE or MOBI_TEXT_REPAIR if utf-8 text is checked, 0 otherwise */
+        unsigned char tail[3]; /**< Incomplete utf-8 sequence at the end of the previous record */
+        size_t tail_size; /**< Length of the incomplete utf-8 sequence */
+        char *repaired; /**< Current record with malformed sequences replaced, allocated in MOBI_TEXT_REPAIR mode */
+    } MOBITextReader;
+    
     /** @} */ // end of raw_structs group
 
     /**
@@ -456,6 +578,23 @@ extern "C"
         MOBIPart *resources; /**< Linked list of reconstructed resources files or NULL if not present */
     } MOBIRawml;
 
+    /**
+     @brief Basic metadata of a document read by mobi_probe()
+     
+     Strings are UTF-8 encoded, they must be freed with mobi_free_probe().
+     In case of hybrid KF7/KF8 file metadata of KF8 part is used.
+     */
+    typedef struct {
+        char *title; /**< Title (updated title from EXTH header or full name), NULL if not present */
+        char *author; /**< First author from EXTH header, NULL if not present */
+        char *language; /**< Language tag (eg. en-us), NULL if not present */
+        uint32_t cover_offset; /**< Cover offset from EXTH header relative to first resource record, MOBI_NOTSET if not present */
+        uint32_t cover_seqnumber; /**< Sequential number of the cover record, MOBI_NOTSET if not present */
+        size_t version; /**< Version of Mobipocket document */
+        bool is_hybrid; /**< True if document is KF7/KF8 hybrid file */
+        bool is_encrypted; /**< True if document is encrypted */
+    } MOBIProbe;
+
     /** @} */ // end of parsed_structs group
     
     /** 
@@ -465,12 +604,24 @@ extern "C"
     MOBI_EXPORT const char * mobi_version(void);
     MOBI_EXPORT MOBI_RET mobi_load_file(MOBIData *m, FILE *file);
     MOBI_EXPORT MOBI_RET mobi_load_filename(MOBIData *m, const char *path);
+    MOBI_EXPORT MOBI_RET mobi_load_stream(MOBIData *m, FILE *file, MOBIRecordCallback callback, void *context);
+    MOBI_EXPORT MOBI_RET mobi_load_mmap(MOBIData *m, const char *path);
+    MOBI_EXPORT MOBI_RET mobi_load_buffer(MOBIData *m, const unsigned char *data, const size_t size, const int flags);
+    MOBI_EXPORT MOBI_RET mobi_probe(MOBIProbe *probe, FILE *file);
+    MOBI_EXPORT MOBI_RET mobi_probe_filename(MOBIProbe *probe, const char *path);
+    MOBI_EXPORT void mobi_free_probe(MOBIProbe *probe);
     
     MOBI_EXPORT MOBIData * mobi_init();
     MOBI_EXPORT void mobi_free(MOBIData *m);
     
     MOBI_EXPORT MOBI_RET mobi_parse_kf7(MOBIData *m);
     MOBI_EXPORT MOBI_RET mobi_parse_kf8(MOBIData *m);
+    MOBI_EXPORT MOBI_RET mobi_load_lazy(MOBIData *m, const bool lazy);
+    MOBI_EXPORT MOBI_RET mobi_set_threads(MOBIData *m, const size_t threads);
+    MOBI_EXPORT MOBI_RET mobi_set_huffcdic_cache(MOBIData *m, const size_t size);
+    MOBI_EXPORT MOBI_RET mobi_set_record_cache(MOBIData *m, const size_t size);
+    MOBI_EXPORT MOBI_RET mobi_get_record_cache_stats(const MOBIData *m, size_t *hits, size_t *misses);
+    MOBI_EXPORT MOBI_RET mobi_load_records_batch(MOBIData **docs, const size_t count);
     
     MOBI_EXPORT MOBI_RET mobi_parse_huffdic(const MOBIData *m, MOBIHuffCdic *cdic);
     MOBI_EXPORT MOBI_RET mobi_parse_fdst(const MOBIData *m, MOBIRawml *rawml);
@@ -478,6 +629,13 @@ extern "C"
     MOBI_EXPORT MOBI_RET mobi_parse_rawml(MOBIRawml *rawml, const MOBIData *m);
     MOBI_EXPORT MOBI_RET mobi_get_rawml(const MOBIData *m, char *text, size_t *len);
     MOBI_EXPORT MOBI_RET mobi_dump_rawml(const MOBIData *m, FILE *file);
+    MOBI_EXPORT MOBI_RET mobi_text_reader_open(MOBITextReader *reader, const MOBIData *m, const int flags);
+    MOBI_EXPORT MOBI_RET mobi_text_reader_next(MOBITextReader *reader, const char **text, size_t *len);
+    MOBI_EXPORT void mobi_text_reader_close(MOBITextReader *reader);
+    MOBI_EXPORT MOBI_RET mobi_get_text_range(const MOBIData *m, const size_t offset, size_t *length, char *text);
+    MOBI_EXPORT MOBI_RET mobi_compress_palmdoc(MOBIPdbRecord **records, size_t *count, const unsigned char *text, const size_t length, const int level, const size_t threads);
+    MOBI_EXPORT MOBI_RET mobi_compress_huffcdic(MOBIPdbRecord **records, size_t *count, MOBIPdbRecord **huffcdic, size_t *huffcdic_count, const unsigned char *text, const size_t length, const size_t threads);
+    MOBI_EXPORT void mobi_free_records(MOBIPdbRecord *records);
     MOBI_EXPORT MOBI_RET mobi_decode_font_resource(unsigned char **decoded_font, size_t *decoded_size, MOBIPart *part);
     MOBI_EXPORT MOBI_RET mobi_decode_audio_resource(unsigned char **decoded_resource, size_t *decoded_size, MOBIPart *part);
     MOBI_EXPORT MOBI_RET mobi_decode_video_resource(unsigned char **decoded_resource, size_t *decoded_size, MOBIPart *part);
@@ -489,6 +647,7 @@ extern "C"
     MOBI_EXPORT size_t mobi_get_kf8offset(const MOBIData *m);
     MOBI_EXPORT size_t mobi_get_kf8boundary_seqnumber(const MOBIData *m);
     MOBI_EXPORT size_t mobi_get_record_extrasize(const MOBIPdbRecord *record, const uint16_t flags);
+    MOBI_EXPORT MOBI_RET mobi_get_trailing_entries(const MOBIData *m, const MOBITrailingEntries **entries);
     MOBI_EXPORT size_t mobi_get_fileversion(const MOBIData *m);
     MOBI_EXPORT size_t mobi_get_fdst_record_number(const MOBIData *m);
     MOBI_EXPORT MOBIExthMeta mobi_get_exthtagmeta_by_tag(const MOBIExthTag tag);
@@ -497,7 +497,7 @@ MOBI_RET mobi_reconstruct_resources(const MOBIData *m, MOBIRawml *rawml) {
     while (curr_record != NULL) {
         const MOBIFiletype filetype = mobi_determine_resource_type(curr_record);
         if (filetype == T_UNKNOWN) {
-            curr_record = curr_record->next;
+            curr_record = mobi_get_next_record(m, curr_record);
             i++;
             continue;
         }
@@ -541,7 +541,7 @@ MOBI_RET mobi_reconstruct_resources(const MOBIData *m, MOBIRawml *rawml) {
         
         curr_part->uid = i;
         curr_part->next = NULL;
-        curr_record = curr_record->next;
+        curr_record = mobi_get_next_record(m, curr_record);
         i++;
         parts_count++;
     }
@@ -563,23 +563,18 @@ MOBI_RET mobi_reconstruct_resources(const MOBIData *m, MOBIRawml *rawml) {
  */
 MOBI_RET mobi_process_replica(unsigned char *pdf, const char *text, size_t *length) {
     MOBI_RET ret = MOBI_SUCCESS;
-    MOBIBuffer *buf = buffer_init_null(*length);
-    if (buf == NULL) {
-        return MOBI_MALLOC_FAILED;
-    }
-    buf->data = (unsigned char*) text;
+    MOBIBuffer buf_view;
+    MOBIBuffer *buf = buffer_init_view(&buf_view, (unsigned char*) text, *length);
     buf->offset = 12;
     size_t pdf_offset = buffer_get32(buf); /* offset 12 */
     size_t pdf_length = buffer_get32(buf); /* 16 */
     if (pdf_length > *length) {
         debug_print("PDF size from replica header too large: %zu", pdf_length);
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     buf->offset = pdf_offset;
     buffer_getraw(pdf, buf, pdf_length);
     ret = buf->error;
-    buffer_free_null(buf);
     *length = pdf_length;
     return ret;
 }
@@ -680,6 +675,71 @@ MOBI_RET mobi_reconstruct_flow(MOBIRawml *rawml, const char *text, const size_t
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief Fragment inserted into skeleton part, read from FRAG index
+ */
+typedef struct {
+    size_t position; /**< Insert position, relative to the skeleton start in assembled part */
+    const unsigned char *data; /**< Fragment data in flow part */
+    size_t length; /**< Fragment length */
+} MOBISkelFragment;
+
+/**
+ @brief Assemble skeleton part with its fragments in a single forward pass
+ 
+ Each fragment is inserted at its position in text assembled so far.
+ Text that follows the last insert position is kept as a stack of pending slices of the flow part
+ (the most recent fragment on top), so bytes are copied to the output only once.
+ Fragment inserted before the last insert position is moved into already written text.
+ 
+ @param[out] out Output, size of skeleton and all its fragments
+ @param[in] skel Skeleton data
+ @param[in] skel_length Skeleton length
+ @param[in] fragments Fragments in order of insertion, positions are checked to be within assembled text
+ @param[in] count Number of fragments
+ @param[in,out] pending Work area for count + 1 pending slices
+ */
+static void mobi_assemble_skeleton(unsigned char *out, const unsigned char *skel, const size_t skel_length, const MOBISkelFragment *fragments, const size_t count, MOBISkelFragment *pending) {
+    size_t top = 0;
+    pending[top].data = skel;
+    pending[top].length = skel_length;
+    size_t written = 0;
+    for (size_t i = 0; i < count; i++) {
+        const MOBISkelFragment *fragment = &fragments[i];
+        if (fragment->position < written) {
+            /* rare case, fragment inserted into already written text */
+            memmove(out + fragment->position + fragment->length, out + fragment->position, written - fragment->position);
+            memcpy(out + fragment->position, fragment->data, fragment->length);
+            written += fragment->length;
+            continue;
+        }
+        /* write pending text up to insert position */
+        size_t advance = fragment->position - written;
+        while (advance) {
+            MOBISkelFragment *slice = &pending[top];
+            const size_t length = min(advance, slice->length);
+            memcpy(out + written, slice->data, length);
+            written += length;
+            advance -= length;
+            slice->data += length;
+            slice->length -= length;
+            if (slice->length == 0 && top > 0) {
+                top--;
+            }
+        }
+        pending[++top] = *fragment;
+    }
+    /* write the rest */
+    while (true) {
+        memcpy(out + written, pending[top].data, pending[top].length);
+        written += pending[top].length;
+        if (top == 0) {
+            break;
+        }
+        top--;
+    }
+}
+
 /**
  @brief Parse raw html into html parts. Use index entries if present to parse file
  
@@ -693,12 +753,11 @@ MOBI_RET mobi_reconstruct_parts(MOBIRawml *rawml) {
         return MOBI_INIT_FAILED;
     }
     /* take first part, xhtml */
-    MOBIBuffer *buf = buffer_init_null(rawml->flow->size);
-    buf->data = rawml->flow->data;
+    MOBIBuffer buf_view;
+    MOBIBuffer *buf = buffer_init_view(&buf_view, rawml->flow->data, rawml->flow->size);
     rawml->markup = calloc(1, sizeof(MOBIPart));
     if (rawml->markup == NULL) {
         debug_print("%s", "Memory allocation for markup part failed\n");
-        buffer_free_null(buf);
         return MOBI_MALLOC_FAILED;
     }
     MOBIPart *curr = rawml->markup;
@@ -707,7 +766,6 @@ MOBI_RET mobi_reconstruct_parts(MOBIRawml *rawml) {
         unsigned char *data = malloc(buf->maxlen);
         if (data == NULL) {
             debug_print("%s", "Memory allocation failed\n");
-            buffer_free_null(buf);
             return MOBI_MALLOC_FAILED;
         }
         memcpy(data, buf->data, buf->maxlen);
@@ -716,121 +774,120 @@ MOBI_RET mobi_reconstruct_parts(MOBIRawml *rawml) {
         curr->data = data;
         curr->type = rawml->flow->type;
         curr->next = NULL;
-        buffer_free_null(buf);
         return MOBI_SUCCESS;
     }
     /* parse skeleton data */
+    const size_t flow_size = rawml->flow->size;
     size_t i = 0, j = 0;
     while (i < rawml->skel->entries_count) {
         const MOBIIndexEntry *entry = &rawml->skel->entries[i];
         uint32_t fragments_count;
         ret = mobi_get_indxentry_tagvalue(&fragments_count, entry, INDX_TAG_SKEL_COUNT);
         if (ret != MOBI_SUCCESS) {
-            buffer_free_null(buf);
             return ret;
         }
         uint32_t skel_position;
         ret = mobi_get_indxentry_tagvalue(&skel_position, entry, INDX_TAG_SKEL_POSITION);
         if (ret != MOBI_SUCCESS) {
-            buffer_free_null(buf);
             return ret;
         }
         uint32_t skel_length;
         ret = mobi_get_indxentry_tagvalue(&skel_length, entry, INDX_TAG_SKEL_LENGTH);
         if (ret != MOBI_SUCCESS) {
-            buffer_free_null(buf);
             return ret;
         }
         debug_print("%zu\t%s\t%i\t%i\t%i\n", i, entry->label, fragments_count, skel_position, skel_length);
-        char *skel_text = malloc(skel_length + 1);
-        buf->offset = skel_position;
-        buffer_getstring(skel_text, buf, skel_length);
-        while (fragments_count--) {
-            entry = &rawml->frag->entries[j];
+        if ((size_t) skel_position + skel_length > flow_size) {
+            debug_print("%s", "Skeleton exceeds flow part\n");
+            return MOBI_DATA_CORRUPT;
+        }
+        if (rawml->frag == NULL || j + fragments_count > rawml->frag->entries_count) {
+            debug_print("%s", "Fragment index too short\n");
+            return MOBI_DATA_CORRUPT;
+        }
+        /* fragments and pending slices for assembly */
+        MOBISkelFragment *fragments = malloc((2 * (size_t) fragments_count + 1) * sizeof(MOBISkelFragment));
+        if (fragments == NULL) {
+            debug_print("%s", "Memory allocation failed\n");
+            return MOBI_MALLOC_FAILED;
+        }
+        /* fragments follow skeleton in flow part, final size of the part is known before assembly */
+        size_t frag_offset = (size_t) skel_position + skel_length;
+        size_t part_length = skel_length;
+        for (size_t k = 0; k < fragments_count; k++) {
+            entry = &rawml->frag->entries[j + k];
             uint32_t insert_position = (uint32_t) strtoul(entry->label, NULL, 10);
-            insert_position -= skel_position;
-            uint32_t cncx_offset;
-            ret = mobi_get_indxentry_tagvalue(&cncx_offset, entry, INDX_TAG_FRAG_AID_CNCX);
-            if (ret != MOBI_SUCCESS) {
-                free(skel_text);
-                buffer_free_null(buf);
-                return ret;
-            }
             uint32_t file_number;
             ret = mobi_get_indxentry_tagvalue(&file_number, entry, INDX_TAG_FRAG_FILE_NR);
             if (ret != MOBI_SUCCESS) {
-                free(skel_text);
-                buffer_free_null(buf);
-                return ret;
-            }
-            uint32_t seq_number;
-            ret = mobi_get_indxentry_tagvalue(&seq_number, entry, INDX_TAG_FRAG_SEQUENCE_NR);
-            if (ret != MOBI_SUCCESS) {
-                free(skel_text);
-                buffer_free_null(buf);
-                return ret;
-            }
-            uint32_t frag_position;
-            ret = mobi_get_indxentry_tagvalue(&frag_position, entry, INDX_TAG_FRAG_POSITION);
-            if (ret != MOBI_SUCCESS) {
-                free(skel_text);
-                buffer_free_null(buf);
+                free(fragments);
                 return ret;
             }
             uint32_t frag_length;
             ret = mobi_get_indxentry_tagvalue(&frag_length, entry, INDX_TAG_FRAG_LENGTH);
             if (ret != MOBI_SUCCESS) {
-                free(skel_text);
-                buffer_free_null(buf);
+                free(fragments);
                 return ret;
             }
+#if (MOBI_DEBUG)
+            uint32_t cncx_offset = 0;
+            uint32_t seq_number = 0;
+            uint32_t frag_position = 0;
+            mobi_get_indxentry_tagvalue(&cncx_offset, entry, INDX_TAG_FRAG_AID_CNCX);
+            mobi_get_indxentry_tagvalue(&seq_number, entry, INDX_TAG_FRAG_SEQUENCE_NR);
+            mobi_get_indxentry_tagvalue(&frag_position, entry, INDX_TAG_FRAG_POSITION);
             /* FIXME: aid_text is unused */
-            const MOBIPdbRecord *cncx_record = rawml->frag->cncx_record;
-            char *aid_text = mobi_get_cncx_string(cncx_record, cncx_offset);
+            char *aid_text = mobi_get_cncx_string(rawml->frag->cncx_record, cncx_offset);
+            debug_print("posfid[%zu]\t%i\t%i\t%s\t%i\t%i\t%i\t%i\n", j + k, insert_position, cncx_offset, aid_text, file_number, seq_number, frag_position, frag_length);
+            free(aid_text);
+#endif
             if (file_number != i) {
                 debug_print("%s", "SKEL part number and fragment sequence number don't match\n");
-                free(aid_text);
-                free(skel_text);
-                buffer_free_null(buf);
+                free(fragments);
                 return MOBI_DATA_CORRUPT;
             }
-            debug_print("posfid[%zu]\t%i\t%i\t%s\t%i\t%i\t%i\t%i\n", j, insert_position, cncx_offset, aid_text, file_number, seq_number, frag_position, frag_length);
-            free(aid_text);
-            char *tmp = realloc(skel_text, (skel_length + frag_length + 1));
-            if (tmp == NULL) {
-                free(skel_text);
-                buffer_free_null(buf);
-                return MOBI_MALLOC_FAILED;
+            if (insert_position < skel_position || insert_position - skel_position > part_length) {
+                debug_print("Fragment insert position out of range (%u)\n", insert_position);
+                free(fragments);
+                return MOBI_DATA_CORRUPT;
             }
-            skel_text = tmp;
-            size_t skel_end_length = skel_length - insert_position;
-            char skel_text_end[skel_end_length + 1];
-            strncpy(skel_text_end, skel_text + insert_position, skel_end_length);
-            skel_text_end[skel_end_length] = '\0';
-            skel_text[insert_position] = '\0';
-            buffer_appendstring(skel_text, buf, frag_length);
-            skel_length += frag_length;
-            strncat(skel_text, skel_text_end, skel_length + 1);
-            j++;
-            
+            if (frag_offset + frag_length > flow_size) {
+                debug_print("%s", "Fragment exceeds flow part\n");
+                free(fragments);
+                return MOBI_DATA_CORRUPT;
+            }
+            fragments[k].position = insert_position - skel_position;
+            fragments[k].data = rawml->flow->data + frag_offset;
+            fragments[k].length = frag_length;
+            frag_offset += frag_length;
+            part_length += frag_length;
         }
+        unsigned char *part_text = malloc(part_length + 1);
+        if (part_text == NULL) {
+            debug_print("%s", "Memory allocation failed\n");
+            free(fragments);
+            return MOBI_MALLOC_FAILED;
+        }
+        mobi_assemble_skeleton(part_text, rawml->flow->data + skel_position, skel_length, fragments, fragments_count, fragments + fragments_count);
+        part_text[part_length] = '\0';
+        free(fragments);
+        j += fragments_count;
         if (i > 0) {
             curr->next = calloc(1, sizeof(MOBIPart));
             if (curr->next == NULL) {
                 debug_print("%s", "Memory allocation for markup part failed\n");
-                buffer_free_null(buf);
+                free(part_text);
                 return MOBI_MALLOC_FAILED;
             }
             curr = curr->next;
         }
         curr->uid = i;
-        curr->size = skel_length;
-        curr->data = (unsigned char *) skel_text;
+        curr->size = part_length;
+        curr->data = part_text;
         curr->type = T_HTML;
         curr->next = NULL;
         i++;
     }
-    buffer_free_null(buf);
     return MOBI_SUCCESS;
 }
 
@@ -1515,49 +1572,13 @@ MOBI_RET mobi_parse_rawml(MOBIRawml *rawml, const MOBIData *m) {
         return MOBI_INIT_FAILED;
     }
     
-    /* Get maximal size of text data */
-    const size_t maxlen = mobi_get_text_maxsize(m);
-    char *text = malloc(maxlen + 1);
-    if (text == NULL) {
-        debug_print("%s", "Memory allocation failed\n");
-        return MOBI_MALLOC_FAILED;
-    }
-    /* Extract text records, unpack, merge and copy it to text string */
-    size_t length = maxlen;
-    ret = mobi_get_rawml(m, text, &length);
+    /* Extract text records, unpack, convert to utf-8 and merge them into text string */
+    char *text;
+    size_t length;
+    ret = mobi_get_rawml_utf8(m, &text, &length);
     if (ret != MOBI_SUCCESS) {
         debug_print("%s", "Error parsing text\n");
-        free(text);
-        return MOBI_MALLOC_FAILED;
-    }
-    /* Work on utf-8 encoded text */
-    if (memcmp(text, REPLICA_MAGIC, 4) != 0 && mobi_is_cp1252(m)) {
-        /* extreme case in which each input character is converted
-         to 3-byte utf-8 sequence */
-        size_t out_length = 3 * length + 1;
-        char *out_text = malloc(out_length);
-        if (out_text == NULL) {
-            debug_print("%s", "Memory allocation failed\n");
-            free(text);
-            return MOBI_MALLOC_FAILED;
-        }
-        ret = mobi_cp1252_to_utf8(out_text, text, &out_length, length);
-        free(text);
-        if (ret != MOBI_SUCCESS || out_length == 0) {
-            debug_print("%s", "conversion from cp1252 to utf8 failed\n");
-            free(out_text);
-            return ret;
-        }
-        text = malloc(out_length + 1);
-        if (text == NULL) {
-            debug_print("%s", "Memory allocation failed\n");
-            free(out_text);
-            return MOBI_MALLOC_FAILED;
-        }
-        memcpy(text, out_text, out_length);
-        free(out_text);
-        text[out_length] = '\0';
-        length = out_length;
+        return ret;
     }
     
     if (mobi_exists_fdst(m)) {
@@ -13,33 +13,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef USE_IO_URING
+#include <liburing.h>
+#define MOBI_URING_DEPTH 256 /**< Maximum number of record reads in flight */
+#endif
 #include "read.h"
 #include "util.h"
 #include "index.h"
 #include "debug.h"
 
 /**
- @brief Read palm database header from file into MOBIData structure (MOBIPdbHeader)
+ @brief Parse palm database header from buffer into MOBIData structure (MOBIPdbHeader)
  
- @param[in,out] m MOBIData structure to be filled with read data
- @param[in] file Filedescriptor to read from
+ @param[in,out] m MOBIData structure to be filled with parsed data
+ @param[in] buf MOBIBuffer buffer to read from
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_load_pdbheader(MOBIData *m, FILE *file) {
+MOBI_RET mobi_parse_pdbheader(MOBIData *m, MOBIBuffer *buf) {
     if (m == NULL) {
         debug_print("%s", "Mobi structure not initialized\n");
         return MOBI_INIT_FAILED;
     }
-    if (!file) {
-        return MOBI_FILE_NOT_FOUND;
-    }
-    MOBIBuffer *buf = buffer_init(PALMDB_HEADER_LEN);
-    if (buf == NULL) {
-        return MOBI_MALLOC_FAILED;
-    }
-    const size_t len = fread(buf->data, 1, PALMDB_HEADER_LEN, file);
-    if (len != PALMDB_HEADER_LEN) {
-        buffer_free(buf);
+    if (buf->offset + PALMDB_HEADER_LEN > buf->maxlen) {
+        debug_print("%s", "Palm database header too short\n");
         return MOBI_DATA_CORRUPT;
     }
     m->ph = calloc(1, sizeof(MOBIPdbHeader));
@@ -62,13 +65,61 @@ MOBI_RET mobi_load_pdbheader(MOBIData *m, FILE *file) {
     m->ph->uid = buffer_get32(buf);
     m->ph->next_rec = buffer_get32(buf);
     m->ph->rec_count = buffer_get16(buf);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Read palm database header from file into MOBIData structure (MOBIPdbHeader)
+ 
+ @param[in,out] m MOBIData structure to be filled with read data
+ @param[in] file Filedescriptor to read from
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_pdbheader(MOBIData *m, FILE *file) {
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    if (!file) {
+        return MOBI_FILE_NOT_FOUND;
+    }
+    MOBIBuffer *buf = buffer_init(PALMDB_HEADER_LEN);
+    if (buf == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    const size_t len = fread(buf->data, 1, PALMDB_HEADER_LEN, file);
+    if (len != PALMDB_HEADER_LEN) {
+        buffer_free(buf);
+        return MOBI_DATA_CORRUPT;
+    }
+    const MOBI_RET ret = mobi_parse_pdbheader(m, buf);
     buffer_free(buf);
+    return ret;
+}
+
+/**
+ @brief Check if palm database header describes supported document
+ 
+ @param[in] m MOBIData structure with loaded palm database header
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_check_pdbheader(const MOBIData *m) {
+    if (strcmp(m->ph->type, "BOOK") != 0 && strcmp(m->ph->type, "TEXt") != 0) {
+        debug_print("Unsupported file type: %s\n", m->ph->type);
+        return MOBI_FILE_UNSUPPORTED;
+    }
+    if (m->ph->rec_count == 0) {
+        debug_print("%s", "No records found\n");
+        return MOBI_DATA_CORRUPT;
+    }
     return MOBI_SUCCESS;
 }
 
 /**
  @brief Read list of database records from file into MOBIData structure (MOBIPdbRecord)
  
+ Whole record info table is read at once and parsed with mobi_parse_reclist().
+ 
  @param[in,out] m MOBIData structure to be filled with read data
  @param[in] file Filedescriptor to read from
  @return MOBI_RET status code (on success MOBI_SUCCESS)
@@ -82,39 +133,83 @@ MOBI_RET mobi_load_reclist(MOBIData *m, FILE *file) {
         debug_print("%s", "File not ready\n");
         return MOBI_FILE_NOT_FOUND;
     }
-    m->rec = calloc(1, sizeof(MOBIPdbRecord));
-    if (m->rec == NULL) {
-        debug_print("%s", "Memory allocation for pdb record failed\n");
+    const size_t list_size = (size_t) m->ph->rec_count * PALMDB_RECORD_INFO_SIZE;
+    MOBIBuffer *buf = buffer_init(list_size);
+    if (buf == NULL) {
         return MOBI_MALLOC_FAILED;
     }
-    MOBIPdbRecord *curr = m->rec;
-    for (int i = 0; i < m->ph->rec_count; i++) {
-        MOBIBuffer *buf = buffer_init(PALMDB_RECORD_INFO_SIZE);
-        if (buf == NULL) {
-            return MOBI_MALLOC_FAILED;
-        }
-        const size_t len = fread(buf->data, 1, PALMDB_RECORD_INFO_SIZE, file);
-        if (len != PALMDB_RECORD_INFO_SIZE) {
-            buffer_free(buf);
+    const size_t len = fread(buf->data, 1, list_size, file);
+    if (len != list_size) {
+        debug_print("%s", "Record info list too short\n");
+        buffer_free(buf);
+        return MOBI_DATA_CORRUPT;
+    }
+    const MOBI_RET ret = mobi_parse_reclist(m, buf);
+    buffer_free(buf);
+    return ret;
+}
+
+/**
+ @brief Parse list of database records from buffer into MOBIData structure (MOBIPdbRecord)
+ 
+ Only records metadata is parsed, data of the records is not loaded.
+ Records array of lookup tables (m->rec_index) is filled in the same pass.
+ Offsets of the records must not decrease.
+ 
+ @param[in,out] m MOBIData structure to be filled with parsed data
+ @param[in] buf MOBIBuffer buffer to read from, offset pointing at the first record info entry
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_parse_reclist(MOBIData *m, MOBIBuffer *buf) {
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    const size_t rec_count = m->ph->rec_count;
+    const size_t list_size = rec_count * PALMDB_RECORD_INFO_SIZE;
+    if (buf->offset + list_size > buf->maxlen) {
+        debug_print("%s", "Record info list too short\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    mobi_free_record_index(m);
+    m->rec_index = calloc(1, sizeof(MOBIRecordIndex));
+    if (m->rec_index == NULL) {
+        debug_print("%s", "Memory allocation for records index failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBIRecordIndex *index = m->rec_index;
+    index->records = malloc(rec_count * sizeof(*index->records));
+    if (index->records == NULL) {
+        debug_print("%s", "Memory allocation for records index failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    const unsigned char *entry = buf->data + buf->offset;
+    buf->offset += list_size;
+    MOBIPdbRecord *curr = NULL;
+    for (size_t i = 0; i < rec_count; i++, entry += PALMDB_RECORD_INFO_SIZE) {
+        /* 0: offset (32 bit), 4: attributes (8 bit), 5: uid (24 bit) */
+        const uint32_t offset = (uint32_t) entry[0] << 24 | (uint32_t) entry[1] << 16 | (uint32_t) entry[2] << 8 | entry[3];
+        if (curr != NULL && offset < curr->offset) {
+            debug_print("Wrong offset of record %zu\n", i);
             return MOBI_DATA_CORRUPT;
         }
-        if (i > 0) {
-            curr->next = calloc(1, sizeof(MOBIPdbRecord));
-            if (curr->next == NULL) {
-                debug_print("%s", "Memory allocation for pdb record failed\n");
-                return MOBI_MALLOC_FAILED;
-            }
-            curr = curr->next;
+        MOBIPdbRecord *rec = calloc(1, sizeof(MOBIPdbRecord));
+        if (rec == NULL) {
+            debug_print("%s", "Memory allocation for pdb record failed\n");
+            return MOBI_MALLOC_FAILED;
         }
-        curr->offset = buffer_get32(buf);
-        curr->attributes = buffer_get8(buf);
-        const uint8_t h = buffer_get8(buf);
-        const uint16_t l = buffer_get16(buf);
-        curr->uid =  (uint32_t) h << 16 | l;
-        curr->next = NULL;
-        buffer_free(buf);
+        if (curr == NULL) {
+            m->rec = rec;
+        } else {
+            curr->next = rec;
+        }
+        curr = rec;
+        curr->offset = offset;
+        curr->attributes = entry[4];
+        curr->uid = (uint32_t) entry[5] << 16 | (uint32_t) entry[6] << 8 | entry[7];
+        index->records[index->count++] = curr;
     }
-    return MOBI_SUCCESS;
+    return mobi_build_record_uidmap(index);
 }
 
 /**
@@ -149,6 +244,11 @@ MOBI_RET mobi_load_rec(MOBIData *m, FILE *file) {
         }
 
         curr->size = size;
+        if (m->storage == MOBI_STORAGE_LAZY) {
+            /* data will be read on first access */
+            curr = next;
+            continue;
+        }
         ret = mobi_load_recdata(curr, file);
         if (ret  != MOBI_SUCCESS) {
             debug_print("Error loading record uid %i data\n", curr->uid);
@@ -186,6 +286,258 @@ MOBI_RET mobi_load_recdata(MOBIPdbRecord *rec, FILE *file) {
     return MOBI_SUCCESS;
 }
 
+#ifndef _WIN32
+/**
+ @brief Read remaining part of record data with pread
+ 
+ @param[in] fd File descriptor to read from
+ @param[in,out] data Memory area for record data, at least rec->size long
+ @param[in] rec MOBIPdbRecord structure with set offset and size
+ @param[in] done Number of bytes already read into data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_pread_recdata(const int fd, unsigned char *data, const MOBIPdbRecord *rec, size_t done) {
+    while (done < rec->size) {
+        const ssize_t count = pread(fd, data + done, rec->size - done, (off_t) (rec->offset + done));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            debug_print("Truncated data in record %i\n", rec->uid);
+            return MOBI_DATA_CORRUPT;
+        }
+        done += (size_t) count;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Attach data read on demand to the record, unless other thread already did it
+ 
+ @param[in,out] rec MOBIPdbRecord structure
+ @param[in] data Record data, released if not used
+ */
+static void mobi_publish_recdata(MOBIPdbRecord *rec, unsigned char *data) {
+    unsigned char *expected = NULL;
+    if (!__atomic_compare_exchange_n(&rec->data, &expected, data, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        /* other thread loaded the record in the meantime */
+        free(data);
+    }
+}
+#endif
+
+/**
+ @brief Read record data from file on first access, if document was loaded in lazy mode
+ 
+ Data is read with pread, so file offset is not modified and concurrent calls are safe.
+ If the record data is already present, function does nothing.
+ 
+ @param[in] m MOBIData structure with loaded list of records
+ @param[in,out] rec MOBIPdbRecord structure to be filled with read data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_recdata_lazy(const MOBIData *m, MOBIPdbRecord *rec) {
+    if (m->storage != MOBI_STORAGE_LAZY) {
+        return MOBI_SUCCESS;
+    }
+#ifndef _WIN32
+    if (__atomic_load_n(&rec->data, __ATOMIC_ACQUIRE) != NULL) {
+        return MOBI_SUCCESS;
+    }
+    if (m->fd == -1) {
+        debug_print("%s", "File for lazy loading not available\n");
+        return MOBI_FILE_NOT_FOUND;
+    }
+    unsigned char *data = malloc(rec->size ? rec->size : 1);
+    if (data == NULL) {
+        debug_print("%s", "Memory allocation for pdb record data failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    const MOBI_RET ret = mobi_pread_recdata(m->fd, data, rec, 0);
+    if (ret != MOBI_SUCCESS) {
+        free(data);
+        return ret;
+    }
+    mobi_publish_recdata(rec, data);
+#endif
+    return MOBI_SUCCESS;
+}
+
+#ifdef USE_IO_URING
+/**
+ @brief Pending read of record data submitted to io_uring
+ */
+typedef struct {
+    MOBIPdbRecord *rec; /**< Record to be filled */
+    unsigned char *data; /**< Memory area for record data */
+    size_t done; /**< Number of bytes already read */
+    int fd; /**< File descriptor to read from */
+} MOBIRecRead;
+
+/**
+ @brief Read data of all not yet loaded records of lazily loaded documents using io_uring
+ 
+ Reads of all documents are queued together, up to MOBI_URING_DEPTH reads are in flight at once.
+ Short reads are completed with pread.
+ 
+ @param[in,out] docs Array of MOBIData structures loaded in lazy mode
+ @param[in] count Number of documents in the array
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_ERROR if io_uring is not available
+ */
+static MOBI_RET mobi_load_records_uring(MOBIData **docs, const size_t count) {
+    struct io_uring ring;
+    if (io_uring_queue_init(MOBI_URING_DEPTH, &ring, 0) < 0) {
+        debug_print("%s", "io_uring not available\n");
+        return MOBI_ERROR;
+    }
+    size_t reads_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (docs[i]->storage == MOBI_STORAGE_LAZY && docs[i]->rec_index) {
+            reads_count += docs[i]->rec_index->count;
+        }
+    }
+    MOBIRecRead *reads = calloc(reads_count ? reads_count : 1, sizeof(MOBIRecRead));
+    if (reads == NULL) {
+        debug_print("%s", "Memory allocation for records reads failed\n");
+        io_uring_queue_exit(&ring);
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBI_RET ret = MOBI_SUCCESS;
+    size_t total = 0;
+    for (size_t i = 0; i < count && ret == MOBI_SUCCESS; i++) {
+        const MOBIData *m = docs[i];
+        if (m->storage != MOBI_STORAGE_LAZY || m->rec_index == NULL) {
+            continue;
+        }
+        for (size_t j = 0; j < m->rec_index->count; j++) {
+            MOBIPdbRecord *rec = m->rec_index->records[j];
+            if (__atomic_load_n(&rec->data, __ATOMIC_ACQUIRE) != NULL) {
+                continue;
+            }
+            reads[total].data = malloc(rec->size ? rec->size : 1);
+            if (reads[total].data == NULL) {
+                debug_print("%s", "Memory allocation for pdb record data failed\n");
+                ret = MOBI_MALLOC_FAILED;
+                break;
+            }
+            reads[total].rec = rec;
+            reads[total].fd = m->fd;
+            total++;
+        }
+    }
+    size_t next = 0;
+    /* reads prepared in submission queue, not yet taken by the kernel */
+    size_t queued = 0;
+    /* reads submitted to the kernel, not yet completed */
+    size_t in_flight = 0;
+    while (ret == MOBI_SUCCESS && (next < total || queued > 0 || in_flight > 0)) {
+        /* queue as many reads as the ring accepts */
+        while (next < total && queued + in_flight < MOBI_URING_DEPTH) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+            if (sqe == NULL) {
+                break;
+            }
+            MOBIRecRead *req = &reads[next++];
+            io_uring_prep_read(sqe, req->fd, req->data, (unsigned) req->rec->size, req->rec->offset);
+            io_uring_sqe_set_data(sqe, req);
+            queued++;
+        }
+        const int submitted = io_uring_submit_and_wait(&ring, 1);
+        if (submitted < 0 && submitted != -EINTR) {
+            /* queued reads never reached the kernel, only submitted ones must be waited for */
+            debug_print("io_uring submission failed (%i)\n", submitted);
+            ret = MOBI_ERROR;
+            break;
+        }
+        if (submitted > 0) {
+            /* reads not taken by the kernel stay queued for the next submission */
+            const size_t taken = min((size_t) submitted, queued);
+            queued -= taken;
+            in_flight += taken;
+        }
+        struct io_uring_cqe *cqe;
+        while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+            MOBIRecRead *req = io_uring_cqe_get_data(cqe);
+            const int res = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+            in_flight--;
+            if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                debug_print("Reading record %i failed (%i)\n", req->rec->uid, res);
+                ret = MOBI_DATA_CORRUPT;
+                continue;
+            }
+            req->done = res > 0 ? (size_t) res : 0;
+            /* finish interrupted or short read synchronously */
+            if (ret == MOBI_SUCCESS) {
+                ret = mobi_pread_recdata(req->fd, req->data, req->rec, req->done);
+            }
+            if (ret == MOBI_SUCCESS) {
+                mobi_publish_recdata(req->rec, req->data);
+                req->data = NULL;
+            }
+        }
+    }
+    if (ret != MOBI_SUCCESS) {
+        /* wait for submitted reads still using the buffers */
+        while (in_flight > 0) {
+            struct io_uring_cqe *cqe;
+            if (io_uring_wait_cqe(&ring, &cqe) != 0) {
+                break;
+            }
+            io_uring_cqe_seen(&ring, cqe);
+            in_flight--;
+        }
+    }
+    for (size_t i = 0; i < total; i++) {
+        free(reads[i].data);
+    }
+    free(reads);
+    io_uring_queue_exit(&ring);
+    return ret;
+}
+#endif
+
+/**
+ @brief Read data of all not yet loaded records of documents loaded in lazy mode
+ 
+ Documents must be loaded with mobi_load_file() or mobi_load_filename() after mobi_load_lazy() was set.
+ If the library is built with io_uring support (USE_IO_URING), reads of all documents are submitted together,
+ otherwise, or if io_uring is not available at runtime, records are read one by one with pread.
+ Documents not loaded in lazy mode are skipped.
+ 
+ @param[in,out] docs Array of MOBIData structures
+ @param[in] count Number of documents in the array
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_records_batch(MOBIData **docs, const size_t count) {
+    if (docs == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (docs[i] == NULL) {
+            debug_print("%s", "Mobi structure not initialized\n");
+            return MOBI_INIT_FAILED;
+        }
+    }
+#ifdef USE_IO_URING
+    const MOBI_RET ret = mobi_load_records_uring(docs, count);
+    if (ret != MOBI_ERROR) {
+        return ret;
+    }
+#endif
+    for (size_t i = 0; i < count; i++) {
+        MOBIPdbRecord *curr = docs[i]->rec;
+        while (curr != NULL) {
+            const MOBI_RET ret = mobi_load_recdata_lazy(docs[i], curr);
+            if (ret != MOBI_SUCCESS) {
+                return ret;
+            }
+            curr = curr->next;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
 /**
  @brief Parse EXTH header from Record 0 into MOBIData structure (MOBIExthHeader)
  
@@ -379,15 +731,11 @@ MOBI_RET mobi_parse_record0(MOBIData *m, const size_t seqnumber) {
         debug_print("%s", "Record 0 too short\n");
         return MOBI_DATA_CORRUPT;
     }
-    MOBIBuffer *buf = buffer_init_null(record0->size);
-    if (buf == NULL) {
-        return MOBI_MALLOC_FAILED;
-    }
-    buf->data = record0->data;
+    MOBIBuffer buf_view;
+    MOBIBuffer *buf = buffer_init_view(&buf_view, record0->data, record0->size);
     m->rh = calloc(1, sizeof(MOBIRecord0Header));
     if (m->rh == NULL) {
         debug_print("%s", "Memory allocation for record 0 header failed\n");
-        buffer_free_null(buf);
         return MOBI_MALLOC_FAILED;
     }
     /* parse palmdoc header */
@@ -397,7 +745,6 @@ MOBI_RET mobi_parse_record0(MOBIData *m, const size_t seqnumber) {
          compression != RECORD0_PALMDOC_COMPRESSION &&
          compression != RECORD0_HUFF_COMPRESSION)) {
         debug_print("Wrong record0 header: %c%c%c%c\n", record0->data[0], record0->data[1], record0->data[2], record0->data[3]);
-        buffer_free_null(buf);
         free(m->rh);
         m->rh = NULL;
         return MOBI_DATA_CORRUPT;
@@ -416,7 +763,88 @@ MOBI_RET mobi_parse_record0(MOBIData *m, const size_t seqnumber) {
             mobi_parse_extheader(m, buf);
         }
     } 
-    buffer_free_null(buf);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Read size of trailing entry, stored as variable length value ending at given position
+ 
+ Value is read backwards, at most 4 bytes, the first byte of the value has bit 7 set.
+ 
+ @param[in] data Record data
+ @param[in] end Position following the value
+ @param[out] len Number of bytes of the value
+ @return Read value
+ */
+static size_t mobi_get_trailing_size(const unsigned char *data, const size_t end, size_t *len) {
+    size_t size = 0;
+    size_t shift = 0;
+    *len = 0;
+    while (*len < 4 && *len < end) {
+        const uint8_t byte = data[end - ++(*len)];
+        size |= (size_t) (byte & 0x7f) << shift;
+        shift += 7;
+        if (byte & 0x80) {
+            break;
+        }
+    }
+    return size;
+}
+
+/**
+ @brief Parse trailing entries at the end of text record
+ 
+ Entries are stored from the end of the record in order of extra flags bits, from the highest one.
+ Each entry ends with its size, except multibyte character entry (bit 0), which is the closest to the text.
+ Contents of TBS indexing entry (bit 1) and multibyte character entry are kept, other entries are skipped.
+ 
+ @param[out] entries MOBITrailingEntries structure to be filled
+ @param[in] record MOBIPdbRecord structure containing the record
+ @param[in] flags Flags from MOBI header (extra_flags)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_parse_trailing_entries(MOBITrailingEntries *entries, const MOBIPdbRecord *record, const uint16_t flags) {
+    memset(entries, 0, sizeof(MOBITrailingEntries));
+    if (record->data == NULL) {
+        return MOBI_DATA_CORRUPT;
+    }
+    size_t end = record->size;
+    for (int bit = 15; bit > 0; bit--) {
+        if (flags & (1 << bit)) {
+            size_t len;
+            /* size contains varlen itself and entry data */
+            const size_t size = mobi_get_trailing_size(record->data, end, &len);
+            if (len == 0 || size < len || size > end) {
+                debug_print("Corrupt trailing entry (bit %i) in record %u\n", bit, record->uid);
+                return MOBI_DATA_CORRUPT;
+            }
+            end -= size;
+            if (bit == 1) {
+                entries->tbs_offset = (uint32_t) end;
+                entries->tbs_size = (uint32_t) (size - len);
+            }
+        }
+    }
+    if (flags & 1) {
+        if (end == 0) {
+            debug_print("Corrupt multibyte entry in record %u\n", record->uid);
+            return MOBI_DATA_CORRUPT;
+        }
+        /* two first bits hold number of bytes, last byte holds size */
+        const size_t size = (record->data[end - 1] & 0x3) + 1;
+        if (size > end) {
+            debug_print("Corrupt multibyte entry in record %u\n", record->uid);
+            return MOBI_DATA_CORRUPT;
+        }
+        end -= size;
+        entries->multibyte_size = (uint8_t) (size - 1);
+        memcpy(entries->multibyte, record->data + end, size - 1);
+    }
+    if (end == 0) {
+        debug_print("Trailing entries fill whole record %u\n", record->uid);
+        return MOBI_DATA_CORRUPT;
+    }
+    entries->text_size = (uint32_t) end;
     return MOBI_SUCCESS;
 }
 
@@ -428,36 +856,46 @@ MOBI_RET mobi_parse_record0(MOBIData *m, const size_t seqnumber) {
  @return The size of trailing bytes, MOBI_NOTSET on failure
  */
 size_t mobi_get_record_extrasize(const MOBIPdbRecord *record, const uint16_t flags) {
-    size_t extra_size = 0;
-    MOBIBuffer *buf = buffer_init_null(record->size);
-    if (buf == NULL) {
-        debug_print("%s", "Buffer init in extrasize failed\n");
+    MOBITrailingEntries entries;
+    if (mobi_parse_trailing_entries(&entries, record, flags) != MOBI_SUCCESS) {
         return MOBI_NOTSET;
     }
-    buf->data = record->data;
-    /* set pointer at the end of the record data */
-    buf->offset = buf->maxlen - 1;
-    for (int bit = 15; bit > 0; bit--) {
-        if (flags & (1 << bit)) {
-            /* bit is set */
-            size_t len = 0;
-            /* size contains varlen itself and optional data */
-            const uint32_t size = buffer_get_varlen_dec(buf, &len);
-            /* skip data */
-            /* TODO: read and store in record struct */
-            buf->offset -= (size - len);
-            extra_size += size;
-        }
-    };
-    /* check bit 0 */
-    if (flags & 1) {
-            const uint8_t b = buffer_get8(buf);
-            /* two first bits hold size */
-            extra_size += (b & 0x3) + 1;
-        
+    return record->size - entries.text_size;
+}
+
+/**
+ @brief Build second-level lookup table of code lengths from mincode table
+ 
+ For codes whose first byte is not terminal in table1, code length is found by scanning mincode table.
+ Mincodes for lengths up to 16 bits have zero low 16 bits, so for these lengths
+ the scan result depends only on 16-bit code prefix and can be precomputed.
+ Each entry holds resulting code length, or length from which the scan must be continued if it is above 16.
+ 
+ @param[in,out] huffcdic MOBIHuffCdic structure with parsed HUFF tables
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_build_huff_table2(MOBIHuffCdic *huffcdic) {
+    free(huffcdic->table2);
+    huffcdic->table2 = calloc(0x10000, sizeof(*huffcdic->table2));
+    if (huffcdic->table2 == NULL) {
+        debug_print("%s", "Memory allocation for huffman lookup table failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    for (uint32_t first = 0; first < 256; first++) {
+        const uint32_t t1 = huffcdic->table1[first];
+        if (t1 & 0x80) {
+            /* terminal, code length and maxcode are in table1 */
+            continue;
+        }
+        for (uint32_t prefix = first << 8; prefix < (first + 1) << 8; prefix++) {
+            uint8_t code_length = t1 & 0x1f;
+            while (code_length <= 16 && prefix < (huffcdic->mincode_table[code_length] >> 16)) {
+                code_length++;
+            }
+            huffcdic->table2[prefix] = code_length;
+        }
     }
-    buffer_free_null(buf);
-    return extra_size;
+    return MOBI_SUCCESS;
 }
 
 /**
@@ -468,17 +906,13 @@ size_t mobi_get_record_extrasize(const MOBIPdbRecord *record, const uint16_t fla
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
 MOBI_RET mobi_parse_huff(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record) {
-    MOBIBuffer *buf = buffer_init_null(record->size);
-    if (buf == NULL) {
-        return MOBI_MALLOC_FAILED;
-    }
-    buf->data = record->data;
+    MOBIBuffer buf_view;
+    MOBIBuffer *buf = buffer_init_view(&buf_view, record->data, record->size);
     char huff_magic[5];
     buffer_getstring(huff_magic, buf, 4);
     const size_t header_length = buffer_get32(buf);
     if (strncmp(huff_magic, HUFF_MAGIC, 4) != 0 || header_length < HUFF_HEADER_LEN) {
         debug_print("HUFF wrong magic: %s\n", huff_magic);
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     const size_t data1_offset = buffer_get32(buf);
@@ -487,7 +921,6 @@ MOBI_RET mobi_parse_huff(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record) {
     buf->offset = data1_offset;
     if (buf->offset + (256 * 4) > buf->maxlen) {
         debug_print("%s", "HUFF data1 too short\n");
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     /* read 256 indices from data1 big-endian */
@@ -497,7 +930,6 @@ MOBI_RET mobi_parse_huff(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record) {
     buf->offset = data2_offset;
     if (buf->offset + (64 * 4) > buf->maxlen) {
         debug_print("%s", "HUFF data2 too short\n");
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     /* read 32 mincode-maxcode pairs from data2 big-endian */
@@ -509,8 +941,7 @@ MOBI_RET mobi_parse_huff(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record) {
         huffcdic->mincode_table[i] =  mincode << (32 - i);
         huffcdic->maxcode_table[i] =  ((maxcode + 1) << (32 - i)) - 1;
     }
-    buffer_free_null(buf);
-    return MOBI_SUCCESS;
+    return mobi_build_huff_table2(huffcdic);
 }
 
 /**
@@ -522,17 +953,13 @@ MOBI_RET mobi_parse_huff(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record) {
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
 MOBI_RET mobi_parse_cdic(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record, const size_t num) {
-    MOBIBuffer *buf = buffer_init_null(record->size);
-    if (buf == NULL) {
-        return MOBI_MALLOC_FAILED;
-    }
-    buf->data = record->data;
+    MOBIBuffer buf_view;
+    MOBIBuffer *buf = buffer_init_view(&buf_view, record->data, record->size);
     char cdic_magic[5];
     buffer_getstring(cdic_magic, buf, 4);
     const size_t header_length = buffer_get32(buf);
     if (strncmp(cdic_magic, CDIC_MAGIC, 4) != 0 || header_length < CDIC_HEADER_LEN) {
         debug_print("CDIC wrong magic: %s or declared header length: %zu\n", cdic_magic, header_length);
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     /* variables in huffcdic initialized to zero with calloc */
@@ -549,7 +976,6 @@ MOBI_RET mobi_parse_cdic(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record, co
     huffcdic->index_count = index_count;
     if (index_count == 0) {
         debug_print("%s", "CDIC index count is null");
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     /* allocate memory for symbol offsets if not already allocated */
@@ -557,7 +983,6 @@ MOBI_RET mobi_parse_cdic(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record, co
         huffcdic->symbol_offsets = malloc(index_count * sizeof(*huffcdic->symbol_offsets));
         if (huffcdic->symbol_offsets == NULL) {
             debug_print("%s", "CDIC cannot allocate memory");
-            buffer_free_null(buf);
             return MOBI_MALLOC_FAILED;
         }
     }
@@ -569,7 +994,7 @@ MOBI_RET mobi_parse_cdic(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record, co
     if (buf->offset + (index_count * 2) > buf->maxlen) {
         debug_print("%s", "CDIC indices data too short\n");
         free(huffcdic->symbol_offsets);
-        buffer_free_null(buf);
+        huffcdic->symbol_offsets = NULL;
         return MOBI_DATA_CORRUPT;
     }
     /* read i * 2 byte big-endian indices */
@@ -579,13 +1004,12 @@ MOBI_RET mobi_parse_cdic(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record, co
     if (buf->offset + code_length > buf->maxlen) {
         debug_print("%s", "CDIC dictionary data too short\n");
         free(huffcdic->symbol_offsets);
-        buffer_free_null(buf);
+        huffcdic->symbol_offsets = NULL;
         return MOBI_DATA_CORRUPT;
     }
     /* copy pointer to data */
     huffcdic->symbols[num] = record->data + CDIC_HEADER_LEN;
     /* free buffer */
-    buffer_free_null(buf);
     return MOBI_SUCCESS;
 }
 
@@ -619,9 +1043,13 @@ MOBI_RET mobi_parse_huffdic(const MOBIData *m, MOBIHuffCdic *huffcdic) {
         debug_print("%s", "HUFF parsing failed\n");
         return ret;
     }
-    curr = curr->next;
+    curr = mobi_get_next_record(m, curr);
     /* allocate memory for symbols data in each CDIC record */
     huffcdic->symbols = malloc((huff_rec_count - 1) * sizeof(*huffcdic->symbols));
+    if (huffcdic->symbols == NULL) {
+        debug_print("%s", "Memory allocation for huffman symbols failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
     /* get following CDIC records */
     size_t i = 0;
     while (i < huff_rec_count - 1) {
@@ -629,9 +1057,14 @@ MOBI_RET mobi_parse_huffdic(const MOBIData *m, MOBIHuffCdic *huffcdic) {
         if (ret != MOBI_SUCCESS) {
             debug_print("%s", "CDIC parsing failed\n");
             free(huffcdic->symbols);
+            huffcdic->symbols = NULL;
             return ret;
         }
-        curr = curr->next;
+        curr = mobi_get_next_record(m, curr);
+    }
+    if (m->huff_cache_size && huffcdic->index_count) {
+        /* cache is optional, decompression works without it */
+        huffcdic->cache = mobi_init_huffcache(huffcdic->index_count, m->huff_cache_size);
     }
     return MOBI_SUCCESS;
 }
@@ -653,11 +1086,8 @@ MOBI_RET mobi_parse_fdst(const MOBIData *m, MOBIRawml *rawml) {
         return MOBI_DATA_CORRUPT;
     }
     const MOBIPdbRecord *fdst_record = mobi_get_record_by_seqnumber(m, fdst_record_number);
-    MOBIBuffer *buf = buffer_init_null(fdst_record->size);
-    if (buf == NULL) {
-        return MOBI_MALLOC_FAILED;
-    }
-    buf->data = fdst_record->data;
+    MOBIBuffer buf_view;
+    MOBIBuffer *buf = buffer_init_view(&buf_view, fdst_record->data, fdst_record->size);
     char fdst_magic[5];
     buffer_getstring(fdst_magic, buf, 4);
     const size_t data_offset = buffer_get32(buf);
@@ -667,12 +1097,10 @@ MOBI_RET mobi_parse_fdst(const MOBIData *m, MOBIRawml *rawml) {
         section_count != *m->mh->fdst_section_count ||
         data_offset != 12) {
         debug_print("FDST wrong magic: %s, sections count: %zu or data offset: %zu\n", fdst_magic, section_count, data_offset);
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     if ((buf->maxlen - buf->offset) < section_count * 8) {
         debug_print("%s", "Record FDST too short\n");
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     rawml->fdst = malloc(sizeof(MOBIFdst));
@@ -686,7 +1114,53 @@ MOBI_RET mobi_parse_fdst(const MOBIData *m, MOBIRawml *rawml) {
         debug_print("FDST[%zu]:\t%i\t%i\n", i, rawml->fdst->fdst_section_starts[i], rawml->fdst->fdst_section_ends[i]);
         i++;
     }
-    buffer_free_null(buf);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Build records lookup tables if missing and parse Record 0 headers of loaded MOBI document
+ 
+ In case of hybrid KF7/KF8 file, KF8 Record 0 is also parsed (if use_kf8 flag is set)
+ 
+ @param[in,out] m MOBIData structure with loaded records
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_parse_headers(MOBIData *m) {
+    MOBI_RET ret;
+    if (m->rec_index == NULL) {
+        ret = mobi_build_record_index(m);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    ret = mobi_parse_record0(m, 0);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    /* if EXTH is loaded and use_kf8 flag is set parse KF8 record0 for hybrid KF7/KF8 file */
+    if (m->eh && m->use_kf8) {
+        const size_t boundary_rec_number = mobi_get_kf8boundary_seqnumber(m);
+        if (boundary_rec_number != MOBI_NOTSET && boundary_rec_number < UINT32_MAX) {
+            /* it is a hybrid KF7/KF8 file */
+            m->kf8_boundary_offset = (uint32_t) boundary_rec_number;
+            m->next = mobi_init();
+            /* link pdb header and records data to KF8data structure */
+            m->next->ph = m->ph;
+            m->next->rec = m->rec;
+            m->next->rec_index = m->rec_index;
+            m->next->storage = m->storage;
+            m->next->file_data = m->file_data;
+            m->next->file_size = m->file_size;
+            m->next->fd = m->fd;
+            /* close next loop */
+            m->next->next = m;
+            ret = mobi_parse_record0(m->next, boundary_rec_number + 1);
+            if (ret != MOBI_SUCCESS) {
+                return ret;
+            }
+            mobi_swap_mobidata(m);
+        }
+    }
     return MOBI_SUCCESS;
 }
 
@@ -707,62 +1181,496 @@ MOBI_RET mobi_load_file(MOBIData *m, FILE *file) {
     if (ret != MOBI_SUCCESS) {
         return ret;
     }
-    if (strcmp(m->ph->type, "BOOK") != 0 && strcmp(m->ph->type, "TEXt") != 0) {
-        debug_print("Unsupported file type: %s\n", m->ph->type);
-        return MOBI_FILE_UNSUPPORTED;
-    }
-    if (m->ph->rec_count == 0) {
-        debug_print("%s", "No records found\n");
-        return MOBI_DATA_CORRUPT;
+    ret = mobi_check_pdbheader(m);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
     }
     ret = mobi_load_reclist(m, file);
     if (ret != MOBI_SUCCESS) {
         return ret;
     }
+#ifndef _WIN32
+    if (m->use_lazy) {
+        /* keep own descriptor, records data will be read with pread on first access */
+        const int fd = fileno(file);
+        if (fd != -1) {
+            m->fd = dup(fd);
+        }
+        if (m->fd != -1) {
+            m->storage = MOBI_STORAGE_LAZY;
+        } else {
+            debug_print("%s", "Lazy loading not available, reading all records\n");
+        }
+    }
+#endif
     ret = mobi_load_rec(m, file);
     if (ret != MOBI_SUCCESS) {
         return ret;
     }
-    ret = mobi_parse_record0(m, 0);
+    return mobi_parse_headers(m);
+}
+
+/**
+ @brief Read MOBI document from a path into MOBIData structure
+ 
+ @param[in,out] m MOBIData structure to be filled with read data
+ @param[in] path Path to a MOBI document on disk (eg. /home/me/test.mobi)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_filename(MOBIData *m, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        debug_print("%s", "File not found\n");
+        return MOBI_FILE_NOT_FOUND;
+    }
+    const MOBI_RET ret = mobi_load_file(m, file);
+    fclose(file);
+    return ret;
+}
+
+/**
+ @brief Read data of the last record from stream until end of file
+ 
+ @param[in,out] rec MOBIPdbRecord structure to be filled with read data
+ @param[in] file File descriptor to read from
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_stream_last_recdata(MOBIPdbRecord *rec, FILE *file) {
+    size_t capacity = RECORD0_TEXT_SIZE_MAX;
+    size_t size = 0;
+    unsigned char *data = NULL;
+    while (true) {
+        if (size == capacity || data == NULL) {
+            if (size == capacity) {
+                capacity *= 2;
+            }
+            unsigned char *tmp = realloc(data, capacity);
+            if (tmp == NULL) {
+                debug_print("%s", "Memory allocation for pdb record data failed\n");
+                free(data);
+                return MOBI_MALLOC_FAILED;
+            }
+            data = tmp;
+        }
+        const size_t len = fread(data + size, 1, capacity - size, file);
+        size += len;
+        if (len == 0) {
+            break;
+        }
+    }
+    if (ferror(file) || size == 0) {
+        debug_print("Truncated data in record %i\n", rec->uid);
+        free(data);
+        return MOBI_DATA_CORRUPT;
+    }
+    rec->data = data;
+    rec->size = size;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Read MOBI document from non-seekable stream (pipe, socket) into MOBIData structure
+ 
+ File is read strictly forward. Records are consumed in the order of their offsets,
+ the last record ends with end of file.
+ If callback is set, it is called for each record as soon as its data is read,
+ so that processing can overlap with transfer.
+ 
+ @param[in,out] m MOBIData structure to be filled with read data
+ @param[in] file File descriptor to read from, positioned at the start of the document
+ @param[in] callback MOBIRecordCallback function or NULL
+ @param[in,out] context Pointer passed to callback
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_stream(MOBIData *m, FILE *file, MOBIRecordCallback callback, void *context) {
+    MOBI_RET ret;
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    ret = mobi_load_pdbheader(m, file);
     if (ret != MOBI_SUCCESS) {
         return ret;
     }
-    /* if EXTH is loaded and use_kf8 flag is set parse KF8 record0 for hybrid KF7/KF8 file */
-    if (m->eh && m->use_kf8) {
-        const size_t boundary_rec_number = mobi_get_kf8boundary_seqnumber(m);
-        if (boundary_rec_number != MOBI_NOTSET && boundary_rec_number < UINT32_MAX) {
-            /* it is a hybrid KF7/KF8 file */
-            m->kf8_boundary_offset = (uint32_t) boundary_rec_number;
-            m->next = mobi_init();
-            /* link pdb header and records data to KF8data structure */
-            m->next->ph = m->ph;
-            m->next->rec = m->rec;
-            /* close next loop */
-            m->next->next = m;
-            ret = mobi_parse_record0(m->next, boundary_rec_number + 1);
+    ret = mobi_check_pdbheader(m);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    ret = mobi_load_reclist(m, file);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    size_t position = PALMDB_HEADER_LEN + (size_t) m->ph->rec_count * PALMDB_RECORD_INFO_SIZE;
+    size_t seqnumber = 0;
+    MOBIPdbRecord *curr = m->rec;
+    while (curr != NULL) {
+        if (curr->offset < position) {
+            debug_print("Wrong offset of record %i\n", curr->uid);
+            return MOBI_DATA_CORRUPT;
+        }
+        /* skip padding before record data */
+        while (position < curr->offset) {
+            if (fgetc(file) == EOF) {
+                debug_print("Record %i not found\n", curr->uid);
+                return MOBI_DATA_CORRUPT;
+            }
+            position++;
+        }
+        if (curr->next != NULL) {
+            /* offsets are validated to be monotonic */
+            curr->size = curr->next->offset - curr->offset;
+            curr->data = malloc(curr->size ? curr->size : 1);
+            if (curr->data == NULL) {
+                debug_print("%s", "Memory allocation for pdb record data failed\n");
+                return MOBI_MALLOC_FAILED;
+            }
+            if (fread(curr->data, 1, curr->size, file) != curr->size) {
+                debug_print("Truncated data in record %i\n", curr->uid);
+                return MOBI_DATA_CORRUPT;
+            }
+        } else {
+            ret = mobi_stream_last_recdata(curr, file);
             if (ret != MOBI_SUCCESS) {
                 return ret;
             }
-            mobi_swap_mobidata(m);
         }
+        position += curr->size;
+        if (callback) {
+            ret = callback(curr, seqnumber, context);
+            if (ret != MOBI_SUCCESS) {
+                return ret;
+            }
+        }
+        seqnumber++;
+        curr = curr->next;
+    }
+    return mobi_parse_headers(m);
+}
+
+/**
+ @brief Link records data to the memory area holding whole document
+ 
+ Record sizes are calculated from offsets of the following records.
+ Records data is not copied, it points into m->file_data.
+ 
+ @param[in,out] m MOBIData structure with parsed list of records and set file_data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_link_recdata(MOBIData *m) {
+    MOBIPdbRecord *curr = m->rec;
+    while (curr != NULL) {
+        const size_t end = curr->next ? curr->next->offset : m->file_size;
+        if (curr->offset > end || end > m->file_size) {
+            debug_print("Wrong offset of record %i\n", curr->uid);
+            return MOBI_DATA_CORRUPT;
+        }
+        curr->size = end - curr->offset;
+        curr->data = m->file_data + curr->offset;
+        curr = curr->next;
     }
     return MOBI_SUCCESS;
 }
 
 /**
- @brief Read MOBI document from a path into MOBIData structure
+ @brief Parse MOBI document held in memory area set in m->file_data
+ 
+ @param[in,out] m MOBIData structure with set file_data and file_size
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_load_filedata(MOBIData *m) {
+    MOBIBuffer buf_view;
+    MOBIBuffer *buf = buffer_init_view(&buf_view, m->file_data, m->file_size);
+    MOBI_RET ret = mobi_parse_pdbheader(m, buf);
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_check_pdbheader(m);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_parse_reclist(m, buf);
+    }
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    ret = mobi_link_recdata(m);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    return mobi_parse_headers(m);
+}
+
+/**
+ @brief Map MOBI document from a path into memory and parse it into MOBIData structure
+ 
+ Records data is not copied, it points directly into read-only mapping of the file.
+ The mapping is released with mobi_free().
+ On systems without mmap() support it falls back to mobi_load_filename().
  
  @param[in,out] m MOBIData structure to be filled with read data
  @param[in] path Path to a MOBI document on disk (eg. /home/me/test.mobi)
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_load_filename(MOBIData *m, const char *path) {
+MOBI_RET mobi_load_mmap(MOBIData *m, const char *path) {
+#ifdef _WIN32
+    return mobi_load_filename(m, path);
+#else
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        debug_print("%s", "File not found\n");
+        return MOBI_FILE_NOT_FOUND;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return MOBI_FILE_NOT_FOUND;
+    }
+    if (st.st_size < PALMDB_HEADER_LEN) {
+        debug_print("%s", "File too short\n");
+        close(fd);
+        return MOBI_DATA_CORRUPT;
+    }
+    const size_t size = (size_t) st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    /* mapping stays valid after closing descriptor */
+    close(fd);
+    if (data == MAP_FAILED) {
+        debug_print("%s", "Memory mapping of file failed\n");
+        return MOBI_ERROR;
+    }
+    m->storage = MOBI_STORAGE_MMAP;
+    m->file_data = data;
+    m->file_size = size;
+    return mobi_load_filedata(m);
+#endif
+}
+
+/**
+ @brief Parse MOBI document held in memory buffer into MOBIData structure
+ 
+ Records data is not copied, it points directly into the buffer.
+ With MOBI_BUFFER_BORROW flag the buffer must stay valid and unchanged until mobi_free() is called.
+ With MOBI_BUFFER_TAKE flag ownership of the buffer is passed to MOBIData structure,
+ it is released with mobi_free(), also when loading fails.
+ 
+ @param[in,out] m MOBIData structure to be filled with parsed data
+ @param[in] data Memory buffer holding whole MOBI document
+ @param[in] size Size of the buffer
+ @param[in] flags MOBIBufferFlags flag
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_buffer(MOBIData *m, const unsigned char *data, const size_t size, const int flags) {
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    if (data == NULL) {
+        debug_print("%s", "Buffer not initialized\n");
+        return MOBI_PARAM_ERR;
+    }
+    m->storage = (flags & MOBI_BUFFER_TAKE) ? MOBI_STORAGE_BUFFER_OWNED : MOBI_STORAGE_BUFFER;
+    /* document data is never modified */
+    m->file_data = (unsigned char *) data;
+    m->file_size = size;
+    if (size < PALMDB_HEADER_LEN) {
+        debug_print("%s", "Buffer too short\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    return mobi_load_filedata(m);
+}
+
+/**
+ @brief Read single record, its record info entry and the entry of the following record from file
+ 
+ Only the record info entries needed to calculate record size are read.
+ 
+ @param[in] m MOBIData structure with loaded palm database header
+ @param[in] file File descriptor to read from
+ @param[in] seqnumber Sequential number of the record
+ @return Loaded MOBIPdbRecord structure (must be freed by the caller), NULL on failure
+ */
+static MOBIPdbRecord * mobi_probe_record(const MOBIData *m, FILE *file, const size_t seqnumber) {
+    if (seqnumber >= m->ph->rec_count) {
+        debug_print("Record %zu not found\n", seqnumber);
+        return NULL;
+    }
+    const size_t entries = (seqnumber + 1 < m->ph->rec_count) ? 2 : 1;
+    unsigned char info[2 * PALMDB_RECORD_INFO_SIZE];
+    if (fseek(file, (long) (PALMDB_HEADER_LEN + seqnumber * PALMDB_RECORD_INFO_SIZE), SEEK_SET) != 0 ||
+        fread(info, PALMDB_RECORD_INFO_SIZE, entries, file) != entries) {
+        debug_print("%s", "Record info list too short\n");
+        return NULL;
+    }
+    const uint32_t offset = (uint32_t) info[0] << 24 | (uint32_t) info[1] << 16 | (uint32_t) info[2] << 8 | info[3];
+    size_t end;
+    if (entries == 2) {
+        end = (uint32_t) info[8] << 24 | (uint32_t) info[9] << 16 | (uint32_t) info[10] << 8 | info[11];
+    } else {
+        if (fseek(file, 0, SEEK_END) != 0) {
+            return NULL;
+        }
+        const long file_size = ftell(file);
+        end = file_size > 0 ? (size_t) file_size : 0;
+    }
+    if (end <= offset) {
+        debug_print("Wrong size of record %zu\n", seqnumber);
+        return NULL;
+    }
+    MOBIPdbRecord *record = calloc(1, sizeof(MOBIPdbRecord));
+    if (record == NULL) {
+        debug_print("%s", "Memory allocation for pdb record failed\n");
+        return NULL;
+    }
+    record->offset = offset;
+    record->size = end - offset;
+    record->attributes = info[4];
+    record->uid = (uint32_t) info[5] << 16 | (uint32_t) info[6] << 8 | info[7];
+    if (mobi_load_recdata(record, file) != MOBI_SUCCESS) {
+        free(record->data);
+        free(record);
+        return NULL;
+    }
+    return record;
+}
+
+/**
+ @brief Decode string from EXTH record with given tag
+ 
+ @param[in] m MOBIData structure with loaded Record 0 headers
+ @param[in] tag MOBIExthTag EXTH record tag
+ @return Decoded UTF-8 string (must be freed by the caller), NULL if not present
+ */
+static char * mobi_probe_exthstring(const MOBIData *m, const MOBIExthTag tag) {
+    const MOBIExthHeader *exth = mobi_get_exthrecord_by_tag(m, tag);
+    if (exth == NULL) {
+        return NULL;
+    }
+    return mobi_decode_exthstring(m, exth->data, exth->size);
+}
+
+/**
+ @brief Fill MOBIProbe structure with metadata from parsed Record 0 headers
+ 
+ @param[in,out] probe MOBIProbe structure
+ @param[in] m MOBIData structure with loaded Record 0 headers of the preferred part
+ @param[in] m7 MOBIData structure with loaded Record 0 headers of the first part (same as m for non-hybrid files)
+ */
+static void mobi_probe_fill(MOBIProbe *probe, const MOBIData *m, const MOBIData *m7) {
+    probe->is_encrypted = mobi_is_encrypted(m);
+    probe->version = mobi_get_fileversion(m);
+    probe->title = mobi_probe_exthstring(m, EXTH_UPDATEDTITLE);
+    if (probe->title == NULL && m->mh && m->mh->full_name_offset && m->mh->full_name_length) {
+        /* list of records holds only Record 0 */
+        const MOBIPdbRecord *record0 = m->rec;
+        const size_t offset = *m->mh->full_name_offset;
+        const size_t len = *m->mh->full_name_length;
+        if (record0 && offset <= record0->size && len <= record0->size - offset) {
+            probe->title = mobi_decode_exthstring(m, record0->data + offset, len);
+        } else {
+            debug_print("Full name out of Record 0 bounds (%zu, %zu)\n", offset, len);
+        }
+    }
+    probe->author = mobi_probe_exthstring(m, EXTH_AUTHOR);
+    probe->language = mobi_probe_exthstring(m, EXTH_LANGUAGE);
+    if (probe->language == NULL && m->mh && m->mh->locale) {
+        const char *locale = mobi_get_locale_string(*m->mh->locale);
+        if (locale) {
+            probe->language = strdup(locale);
+        }
+    }
+    const MOBIExthHeader *exth = mobi_get_exthrecord_by_tag(m, EXTH_COVEROFFSET);
+    if (exth) {
+        probe->cover_offset = mobi_decode_exthvalue(exth->data, exth->size);
+        /* first resource record is set in KF7 header */
+        if (probe->cover_offset != MOBI_NOTSET && m7->mh && m7->mh->image_index && *m7->mh->image_index != MOBI_NOTSET) {
+            probe->cover_seqnumber = *m7->mh->image_index + probe->cover_offset;
+        }
+    }
+}
+
+/**
+ @brief Read basic metadata of MOBI document without loading whole document
+ 
+ Only palm database header, record info entries of needed records and Record 0
+ (and KF8 Record 0 for hybrid files) are read, so amount of I/O does not depend on the document size.
+ 
+ @param[in,out] probe MOBIProbe structure to be filled, strings must be freed with mobi_free_probe()
+ @param[in] file File descriptor to read from
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_probe(MOBIProbe *probe, FILE *file) {
+    if (probe == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    memset(probe, 0, sizeof(MOBIProbe));
+    probe->cover_offset = MOBI_NOTSET;
+    probe->cover_seqnumber = MOBI_NOTSET;
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBI_RET ret = mobi_load_pdbheader(m, file);
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_check_pdbheader(m);
+    }
+    if (ret == MOBI_SUCCESS) {
+        /* list of records holds only Record 0 */
+        m->rec = mobi_probe_record(m, file, 0);
+        ret = m->rec ? mobi_parse_record0(m, 0) : MOBI_DATA_CORRUPT;
+    }
+    if (ret != MOBI_SUCCESS) {
+        mobi_free(m);
+        return ret;
+    }
+    MOBIData *m8 = NULL;
+    const MOBIExthHeader *exth = mobi_get_exthrecord_by_tag(m, EXTH_KF8BOUNDARY);
+    if (exth) {
+        const size_t boundary = mobi_decode_exthvalue(exth->data, exth->size) - 1;
+        MOBIPdbRecord *record = mobi_probe_record(m, file, boundary);
+        if (record && record->size >= 8 && memcmp(record->data, "BOUNDARY", 8) == 0) {
+            /* it is a hybrid KF7/KF8 file, KF8 structure shares only pdb header */
+            m8 = mobi_init();
+            if (m8) {
+                m8->ph = m->ph;
+                m8->rec = mobi_probe_record(m, file, boundary + 1);
+                if (m8->rec == NULL || mobi_parse_record0(m8, 0) != MOBI_SUCCESS) {
+                    debug_print("%s", "KF8 Record 0 parsing failed\n");
+                    m8->ph = NULL;
+                    mobi_free(m8);
+                    m8 = NULL;
+                }
+            }
+        }
+        if (record) {
+            free(record->data);
+            free(record);
+        }
+    }
+    probe->is_hybrid = (m8 != NULL);
+    mobi_probe_fill(probe, m8 ? m8 : m, m);
+    if (m8) {
+        m8->ph = NULL;
+        mobi_free(m8);
+    }
+    mobi_free(m);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Read basic metadata of MOBI document from a path without loading whole document
+ 
+ @param[in,out] probe MOBIProbe structure to be filled, strings must be freed with mobi_free_probe()
+ @param[in] path Path to a MOBI document on disk (eg. /home/me/test.mobi)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_probe_filename(MOBIProbe *probe, const char *path) {
     FILE *file = fopen(path, "rb");
     if (file == NULL) {
         debug_print("%s", "File not found\n");
         return MOBI_FILE_NOT_FOUND;
     }
-    const MOBI_RET ret = mobi_load_file(m, file);
+    const MOBI_RET ret = mobi_probe(probe, file);
     fclose(file);
     return ret;
 }
@@ -14,10 +14,15 @@
 #include "config.h"
 #include "mobi.h"
 #include "memory.h"
+#include "buffer.h"
 
+MOBI_RET mobi_parse_pdbheader(MOBIData *m, MOBIBuffer *buf);
+MOBI_RET mobi_parse_reclist(MOBIData *m, MOBIBuffer *buf);
 MOBI_RET mobi_load_pdbheader(MOBIData *m, FILE *file);
 MOBI_RET mobi_load_reclist(MOBIData *m, FILE *file);
 MOBI_RET mobi_load_rec(MOBIData *m, FILE *file);
 MOBI_RET mobi_load_recdata(MOBIPdbRecord *rec, FILE *file);
+MOBI_RET mobi_load_recdata_lazy(const MOBIData *m, MOBIPdbRecord *rec);
+MOBI_RET mobi_parse_trailing_entries(MOBITrailingEntries *entries, const MOBIPdbRecord *record, const uint16_t flags);
 
 #endif
@@ -12,7 +12,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 #include "util.h"
+#include "read.h"
 #include "parse_rawml.h"
 #include "index.h"
 #include "debug.h"
@@ -21,6 +25,50 @@
 #include "opf.h"
 #endif
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+/** @brief Number of cp1252 characters processed at once by vector instructions */
+#define MOBI_CP1252_BLOCK 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MOBI_CP1252_BLOCK 16
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define MOBI_CP1252_BLOCK 16
+#endif
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+/** @brief Number of bytes validated at once by vector instructions */
+#define MOBI_UTF8_BLOCK 16
+typedef __m128i MOBIUtf8Vector;
+#define mobi_utf8_load(p) _mm_loadu_si128((const __m128i *) (const void *) (p))
+#define mobi_utf8_set1(c) _mm_set1_epi8((char) (c))
+#define mobi_utf8_and(a, b) _mm_and_si128((a), (b))
+#define mobi_utf8_or(a, b) _mm_or_si128((a), (b))
+#define mobi_utf8_xor(a, b) _mm_xor_si128((a), (b))
+#define mobi_utf8_subs(a, b) _mm_subs_epu8((a), (b))
+#define mobi_utf8_shr4(a) _mm_srli_epi16((a), 4)
+#define mobi_utf8_lookup(table, index) _mm_shuffle_epi8((table), (index))
+#define mobi_utf8_prev(input, prev, n) _mm_alignr_epi8((input), (prev), 16 - (n))
+#define mobi_utf8_is_ascii(a) (_mm_movemask_epi8(a) == 0)
+#define mobi_utf8_any(a) (_mm_movemask_epi8(_mm_cmpeq_epi8((a), _mm_setzero_si128())) != 0xffff)
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define MOBI_UTF8_BLOCK 16
+typedef uint8x16_t MOBIUtf8Vector;
+#define mobi_utf8_load(p) vld1q_u8((const uint8_t *) (p))
+#define mobi_utf8_set1(c) vdupq_n_u8((uint8_t) (c))
+#define mobi_utf8_and(a, b) vandq_u8((a), (b))
+#define mobi_utf8_or(a, b) vorrq_u8((a), (b))
+#define mobi_utf8_xor(a, b) veorq_u8((a), (b))
+#define mobi_utf8_subs(a, b) vqsubq_u8((a), (b))
+#define mobi_utf8_shr4(a) vshrq_n_u8((a), 4)
+#define mobi_utf8_lookup(table, index) vqtbl1q_u8((table), (index))
+#define mobi_utf8_prev(input, prev, n) vextq_u8((prev), (input), 16 - (n))
+#define mobi_utf8_is_ascii(a) (vmaxvq_u8(a) < 0x80)
+#define mobi_utf8_any(a) (vmaxvq_u8(a) != 0)
+#endif
+
 /** @brief Lookup table for cp1252 to utf8 encoding conversion */
 static const unsigned char cp1252_to_utf8[32][3] = {
     {0xe2,0x82,0xac},
@@ -69,10 +117,151 @@ const char * mobi_version(void) {
     return PACKAGE_VERSION;
 }
 
+/**
+ @brief Length of utf-8 sequences for cp1252 characters 0x80-0x9f, 0 for unassigned characters
+ */
+static size_t mobi_cp1252_utf8_size(const unsigned char c) {
+    const unsigned char *seq = cp1252_to_utf8[c - 0x80];
+    return (seq[2] ? 3 : (seq[0] ? 2 : 0));
+}
+
+#ifdef MOBI_CP1252_BLOCK
+/**
+ @brief Count leading plain ascii characters (0x01-0x7f) in block of MOBI_CP1252_BLOCK input characters
+ 
+ Such characters are identical in cp1252 and utf-8 and may be copied as is.
+ 
+ @param[in] in Input block
+ @return Number of leading ascii characters, MOBI_CP1252_BLOCK if the whole block is ascii
+ */
+static size_t mobi_cp1252_ascii_prefix(const unsigned char *in) {
+#if defined(__AVX2__)
+    const __m256i block = _mm256_loadu_si256((const __m256i *) in);
+    const __m256i nulls = _mm256_cmpeq_epi8(block, _mm256_setzero_si256());
+    const unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(block, nulls));
+    return mask ? (size_t) __builtin_ctz(mask) : MOBI_CP1252_BLOCK;
+#elif defined(__SSE2__)
+    const __m128i block = _mm_loadu_si128((const __m128i *) in);
+    const __m128i nulls = _mm_cmpeq_epi8(block, _mm_setzero_si128());
+    const unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_or_si128(block, nulls));
+    return mask ? (size_t) __builtin_ctz(mask) : MOBI_CP1252_BLOCK;
+#else
+    const uint8x16_t block = vld1q_u8(in);
+    const uint8x16_t other = vorrq_u8(vcgeq_u8(block, vdupq_n_u8(0x80)), vceqq_u8(block, vdupq_n_u8(0)));
+    /* narrow to 4 bits per character */
+    const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(other), 4)), 0);
+    return mask ? (size_t) (__builtin_ctzll(mask) / 4) : MOBI_CP1252_BLOCK;
+#endif
+}
+
+/**
+ @brief Copy block of MOBI_CP1252_BLOCK characters
+ 
+ @param[out] out Output buffer
+ @param[in] in Input block
+ */
+static void mobi_cp1252_block_copy(unsigned char *out, const unsigned char *in) {
+#if defined(__AVX2__)
+    _mm256_storeu_si256((__m256i *) out, _mm256_loadu_si256((const __m256i *) in));
+#elif defined(__SSE2__)
+    _mm_storeu_si128((__m128i *) out, _mm_loadu_si128((const __m128i *) in));
+#else
+    vst1q_u8(out, vld1q_u8(in));
+#endif
+}
+
+/**
+ @brief Count utf-8 length of block of MOBI_CP1252_BLOCK input characters
+ 
+ Only handles blocks without null characters and without characters in range 0x80-0x9f,
+ each character in range 0xa0-0xff is encoded with two bytes.
+ 
+ @param[in] in Input block
+ @param[out] size Length of utf-8 encoded block
+ @return True if block was counted, false if it has to be counted character by character
+ */
+static bool mobi_cp1252_block_size(const unsigned char *in, size_t *size) {
+#if defined(__AVX2__)
+    const __m256i block = _mm256_loadu_si256((const __m256i *) in);
+    const __m256i nulls = _mm256_cmpeq_epi8(block, _mm256_setzero_si256());
+    /* signed comparison, true for 0x80-0x9f only */
+    const __m256i c1 = _mm256_cmpgt_epi8(_mm256_set1_epi8((char) 0xa0), block);
+    if (_mm256_movemask_epi8(_mm256_or_si256(nulls, c1))) {
+        return false;
+    }
+    *size = MOBI_CP1252_BLOCK + (size_t) __builtin_popcount((unsigned int) _mm256_movemask_epi8(block));
+    return true;
+#elif defined(__SSE2__)
+    const __m128i block = _mm_loadu_si128((const __m128i *) in);
+    const __m128i nulls = _mm_cmpeq_epi8(block, _mm_setzero_si128());
+    /* signed comparison, true for 0x80-0x9f only */
+    const __m128i c1 = _mm_cmplt_epi8(block, _mm_set1_epi8((char) 0xa0));
+    if (_mm_movemask_epi8(_mm_or_si128(nulls, c1))) {
+        return false;
+    }
+    *size = MOBI_CP1252_BLOCK + (size_t) __builtin_popcount((unsigned int) _mm_movemask_epi8(block));
+    return true;
+#else
+    const uint8x16_t block = vld1q_u8(in);
+    if (vminvq_u8(block) == 0 || vmaxvq_u8(vandq_u8(vcgeq_u8(block, vdupq_n_u8(0x80)), vcltq_u8(block, vdupq_n_u8(0xa0))))) {
+        return false;
+    }
+    *size = MOBI_CP1252_BLOCK + vaddvq_u8(vshrq_n_u8(block, 7));
+    return true;
+#endif
+}
+#endif
+
+/**
+ @brief Get length of cp1252 encoded string converted to utf-8
+ 
+ Conversion stops on the first null character, same as mobi_cp1252_to_utf8().
+ Length does not include terminating null character, unassigned input characters are not counted.
+ Used to allocate output buffer of exact size before conversion.
+ 
+ @param[in] input Input string
+ @param[in] insize Length of the input string
+ @return Length of utf-8 encoded string
+ */
+size_t mobi_cp1252_to_utf8_length(const char *input, const size_t insize) {
+    if (!input) {
+        return 0;
+    }
+    const unsigned char *in = (unsigned char *) input;
+    const unsigned char *inend = in + insize;
+    size_t length = 0;
+#ifdef MOBI_CP1252_BLOCK
+    while (inend - in >= MOBI_CP1252_BLOCK) {
+        size_t block_size;
+        if (mobi_cp1252_block_size(in, &block_size)) {
+            length += block_size;
+            in += MOBI_CP1252_BLOCK;
+            continue;
+        }
+        const unsigned char *block_end = in + MOBI_CP1252_BLOCK;
+        while (in < block_end) {
+            if (*in == 0) {
+                return length;
+            }
+            length += (*in < 0x80) ? 1 : (*in < 0xa0) ? mobi_cp1252_utf8_size(*in) : 2;
+            in++;
+        }
+    }
+#endif
+    while (in < inend && *in) {
+        length += (*in < 0x80) ? 1 : (*in < 0xa0) ? mobi_cp1252_utf8_size(*in) : 2;
+        in++;
+    }
+    return length;
+}
+
 /**
  @brief Convert cp1252 encoded string to utf-8
  
- Maximum length of output string is 3 * (input string length) + 1
+ Maximum length of output string is 3 * (input string length) + 1,
+ exact length may be obtained with mobi_cp1252_to_utf8_length() + 1.
+ Conversion stops on the first null character, output is truncated if buffer is too small.
+ Runs of ascii characters are copied in blocks with SSE2/AVX2/NEON instructions if available.
  
  @param[in,out] output Output string
  @param[in,out] input Input string
@@ -81,41 +270,59 @@ const char * mobi_version(void) {
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
 MOBI_RET mobi_cp1252_to_utf8(char *output, const char *input, size_t *outsize, const size_t insize) {
-    if (!output || !input) {
+    if (!output || !input || *outsize == 0) {
         return MOBI_PARAM_ERR;
     }
     const unsigned char *in = (unsigned char *) input;
     unsigned char *out = (unsigned char *) output;
-    const unsigned char *outend = out + *outsize;
+    /* reserve space for terminating null character */
+    const unsigned char *outend = out + *outsize - 1;
     const unsigned char *inend = in + insize;
-    while (*in && in < inend && out < outend) {
+    while (in < inend && *in) {
+#ifdef MOBI_CP1252_BLOCK
+        if (inend - in >= MOBI_CP1252_BLOCK && outend - out >= MOBI_CP1252_BLOCK) {
+            const size_t ascii = mobi_cp1252_ascii_prefix(in);
+            if (ascii) {
+                /* whole block is stored, output pointer is moved past ascii characters only */
+                mobi_cp1252_block_copy(out, in);
+                in += ascii;
+                out += ascii;
+                continue;
+            }
+        }
+#endif
         if (*in < 0x80) {
-           *out++ = *in++;
+            if (out == outend) {
+                break;
+            }
+            *out++ = *in++;
         }
         else if (*in < 0xa0) {
             /* table lookup */
-            size_t i = 0;
-            while (i < 3) {
-                unsigned char c = cp1252_to_utf8[*in - 0x80][i];
-                if (c == 0) {
-                    break;
-                }
-                *out++ = c;
-                i++;
-            }
-            if (i == 0) {
+            const size_t size = mobi_cp1252_utf8_size(*in);
+            if (size == 0) {
                 /* unassigned character in input */
                 return MOBI_DATA_CORRUPT;
             }
+            if ((size_t) (outend - out) < size) {
+                break;
+            }
+            memcpy(out, cp1252_to_utf8[*in - 0x80], size);
+            out += size;
             in++;
         }
-        else if (*in < 0xc0) {
-            *out++ = 0xc2;
-            *out++ = *in++;
-        }
         else {
-            *out++ = 0xc3;
-            *out++ = (*in++ & 0x3f) + 0x80;
+            if (outend - out < 2) {
+                break;
+            }
+            if (*in < 0xc0) {
+                *out++ = 0xc2;
+                *out++ = *in++;
+            }
+            else {
+                *out++ = 0xc3;
+                *out++ = (*in++ & 0x3f) + 0x80;
+            }
         }
     }
     *out = '\0';
@@ -123,6 +330,240 @@ MOBI_RET mobi_cp1252_to_utf8(char *output, const char *input, size_t *outsize, c
     return MOBI_SUCCESS;
 }
 
+/** @brief Result of utf-8 sequence check */
+typedef enum {
+    MOBI_UTF8_VALID, /**< Complete well-formed sequence */
+    MOBI_UTF8_INVALID, /**< Ill-formed sequence */
+    MOBI_UTF8_INCOMPLETE /**< Well-formed sequence truncated by the end of input */
+} MOBIUtf8Sequence;
+
+/**
+ @brief Check utf-8 sequence at the start of the input
+ 
+ Follows table of well-formed byte sequences from The Unicode Standard (table 3-7).
+ 
+ @param[in] in Input
+ @param[in] available Number of bytes available in the input, at least one
+ @param[out] size Length of the sequence if valid, length of its maximal well-formed part otherwise (at least 1)
+ @return MOBIUtf8Sequence result
+ */
+static MOBIUtf8Sequence mobi_utf8_sequence(const unsigned char *in, const size_t available, size_t *size) {
+    const unsigned char c = in[0];
+    size_t length;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xbf;
+    if (c < 0x80) {
+        *size = 1;
+        return MOBI_UTF8_VALID;
+    }
+    if (c >= 0xc2 && c <= 0xdf) {
+        length = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        length = 3;
+        if (c == 0xe0) {
+            /* overlong */
+            lo = 0xa0;
+        } else if (c == 0xed) {
+            /* surrogates */
+            hi = 0x9f;
+        }
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        length = 4;
+        if (c == 0xf0) {
+            /* overlong */
+            lo = 0x90;
+        } else if (c == 0xf4) {
+            /* above U+10FFFF */
+            hi = 0x8f;
+        }
+    } else {
+        *size = 1;
+        return MOBI_UTF8_INVALID;
+    }
+    for (size_t i = 1; i < length; i++) {
+        if (i == available) {
+            *size = i;
+            return MOBI_UTF8_INCOMPLETE;
+        }
+        if (in[i] < lo || in[i] > hi) {
+            *size = i;
+            return MOBI_UTF8_INVALID;
+        }
+        lo = 0x80;
+        hi = 0xbf;
+    }
+    *size = length;
+    return MOBI_UTF8_VALID;
+}
+
+#ifdef MOBI_UTF8_BLOCK
+/*
+ Vectorized validation, after John Keiser and Daniel Lemire,
+ "Validating UTF-8 In Less Than One Instruction Per Byte".
+ Each byte is classified by three table lookups on high and low nibbles of the previous byte
+ and high nibble of the current byte, bits set in all three lookups are errors.
+ */
+#define MOBI_UTF8_TOO_SHORT (1 << 0)
+#define MOBI_UTF8_TOO_LONG (1 << 1)
+#define MOBI_UTF8_OVERLONG_3 (1 << 2)
+#define MOBI_UTF8_TOO_LARGE (1 << 3)
+#define MOBI_UTF8_SURROGATE (1 << 4)
+#define MOBI_UTF8_OVERLONG_2 (1 << 5)
+#define MOBI_UTF8_TOO_LARGE_1000 (1 << 6)
+#define MOBI_UTF8_OVERLONG_4 (1 << 6)
+#define MOBI_UTF8_TWO_CONTS (1 << 7)
+#define MOBI_UTF8_CARRY (MOBI_UTF8_TOO_SHORT | MOBI_UTF8_TOO_LONG | MOBI_UTF8_TWO_CONTS)
+
+/** @brief Error classes by high nibble of the previous byte */
+static const unsigned char mobi_utf8_byte1_high[16] = {
+    MOBI_UTF8_TOO_LONG, MOBI_UTF8_TOO_LONG, MOBI_UTF8_TOO_LONG, MOBI_UTF8_TOO_LONG,
+    MOBI_UTF8_TOO_LONG, MOBI_UTF8_TOO_LONG, MOBI_UTF8_TOO_LONG, MOBI_UTF8_TOO_LONG,
+    MOBI_UTF8_TWO_CONTS, MOBI_UTF8_TWO_CONTS, MOBI_UTF8_TWO_CONTS, MOBI_UTF8_TWO_CONTS,
+    MOBI_UTF8_TOO_SHORT | MOBI_UTF8_OVERLONG_2,
+    MOBI_UTF8_TOO_SHORT,
+    MOBI_UTF8_TOO_SHORT | MOBI_UTF8_OVERLONG_3 | MOBI_UTF8_SURROGATE,
+    MOBI_UTF8_TOO_SHORT | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000 | MOBI_UTF8_OVERLONG_4
+};
+
+/** @brief Error classes by low nibble of the previous byte */
+static const unsigned char mobi_utf8_byte1_low[16] = {
+    MOBI_UTF8_CARRY | MOBI_UTF8_OVERLONG_3 | MOBI_UTF8_OVERLONG_2 | MOBI_UTF8_OVERLONG_4,
+    MOBI_UTF8_CARRY | MOBI_UTF8_OVERLONG_2,
+    MOBI_UTF8_CARRY,
+    MOBI_UTF8_CARRY,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000 | MOBI_UTF8_SURROGATE,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000,
+    MOBI_UTF8_CARRY | MOBI_UTF8_TOO_LARGE | MOBI_UTF8_TOO_LARGE_1000
+};
+
+/** @brief Error classes by high nibble of the current byte */
+static const unsigned char mobi_utf8_byte2_high[16] = {
+    MOBI_UTF8_TOO_SHORT, MOBI_UTF8_TOO_SHORT, MOBI_UTF8_TOO_SHORT, MOBI_UTF8_TOO_SHORT,
+    MOBI_UTF8_TOO_SHORT, MOBI_UTF8_TOO_SHORT, MOBI_UTF8_TOO_SHORT, MOBI_UTF8_TOO_SHORT,
+    MOBI_UTF8_TOO_LONG | MOBI_UTF8_OVERLONG_2 | MOBI_UTF8_TWO_CONTS | MOBI_UTF8_OVERLONG_3 | MOBI_UTF8_TOO_LARGE_1000 | MOBI_UTF8_OVERLONG_4,
+    MOBI_UTF8_TOO_LONG | MOBI_UTF8_OVERLONG_2 | MOBI_UTF8_TWO_CONTS | MOBI_UTF8_OVERLONG_3 | MOBI_UTF8_TOO_LARGE,
+    MOBI_UTF8_TOO_LONG | MOBI_UTF8_OVERLONG_2 | MOBI_UTF8_TWO_CONTS | MOBI_UTF8_SURROGATE | MOBI_UTF8_TOO_LARGE,
+    MOBI_UTF8_TOO_LONG | MOBI_UTF8_OVERLONG_2 | MOBI_UTF8_TWO_CONTS | MOBI_UTF8_SURROGATE | MOBI_UTF8_TOO_LARGE,
+    MOBI_UTF8_TOO_SHORT, MOBI_UTF8_TOO_SHORT, MOBI_UTF8_TOO_SHORT, MOBI_UTF8_TOO_SHORT
+};
+
+/** @brief Maximal values of the last three bytes of a block, that do not start a sequence continued in the next block */
+static const unsigned char mobi_utf8_incomplete_max[16] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf
+};
+#endif
+
+/**
+ @brief Check whether text is well-formed utf-8
+ 
+ Text must end with a complete sequence. With SSSE3 or NEON instructions
+ 16 bytes are validated at once, runs of ascii characters are skipped.
+ 
+ @param[in] text Input text
+ @param[in] length Length of the text
+ @return True if text is valid
+ */
+static bool mobi_utf8_is_valid(const unsigned char *text, const size_t length) {
+#ifdef MOBI_UTF8_BLOCK
+    const MOBIUtf8Vector byte1_high = mobi_utf8_load(mobi_utf8_byte1_high);
+    const MOBIUtf8Vector byte1_low = mobi_utf8_load(mobi_utf8_byte1_low);
+    const MOBIUtf8Vector byte2_high = mobi_utf8_load(mobi_utf8_byte2_high);
+    const MOBIUtf8Vector incomplete_max = mobi_utf8_load(mobi_utf8_incomplete_max);
+    const MOBIUtf8Vector low_nibble = mobi_utf8_set1(0x0f);
+    MOBIUtf8Vector prev = mobi_utf8_set1(0);
+    MOBIUtf8Vector incomplete = prev;
+    MOBIUtf8Vector error = prev;
+    size_t offset = 0;
+    while (offset < length) {
+        MOBIUtf8Vector input;
+        if (length - offset >= MOBI_UTF8_BLOCK) {
+            input = mobi_utf8_load(text + offset);
+        } else {
+            /* last partial block, padded with ascii null characters */
+            unsigned char last[MOBI_UTF8_BLOCK] = { 0 };
+            memcpy(last, text + offset, length - offset);
+            input = mobi_utf8_load(last);
+        }
+        offset += MOBI_UTF8_BLOCK;
+        if (mobi_utf8_is_ascii(input)) {
+            /* only a sequence started in previous block may be broken */
+            error = mobi_utf8_or(error, incomplete);
+        } else {
+            const MOBIUtf8Vector prev1 = mobi_utf8_prev(input, prev, 1);
+            const MOBIUtf8Vector special = mobi_utf8_and(mobi_utf8_and(
+                mobi_utf8_lookup(byte1_high, mobi_utf8_and(mobi_utf8_shr4(prev1), low_nibble)),
+                mobi_utf8_lookup(byte1_low, mobi_utf8_and(prev1, low_nibble))),
+                mobi_utf8_lookup(byte2_high, mobi_utf8_and(mobi_utf8_shr4(input), low_nibble)));
+            /* third and fourth bytes of three and four byte sequences must be continuation bytes */
+            const MOBIUtf8Vector third = mobi_utf8_subs(mobi_utf8_prev(input, prev, 2), mobi_utf8_set1(0xe0 - 0x80));
+            const MOBIUtf8Vector fourth = mobi_utf8_subs(mobi_utf8_prev(input, prev, 3), mobi_utf8_set1(0xf0 - 0x80));
+            const MOBIUtf8Vector must_continue = mobi_utf8_and(mobi_utf8_or(third, fourth), mobi_utf8_set1(0x80));
+            error = mobi_utf8_or(error, mobi_utf8_xor(must_continue, special));
+        }
+        incomplete = mobi_utf8_subs(input, incomplete_max);
+        prev = input;
+    }
+    error = mobi_utf8_or(error, incomplete);
+    return !mobi_utf8_any(error);
+#else
+    size_t offset = 0;
+    while (offset < length) {
+        if (text[offset] < 0x80) {
+            offset++;
+            continue;
+        }
+        size_t size;
+        if (mobi_utf8_sequence(text + offset, length - offset, &size) != MOBI_UTF8_VALID) {
+            return false;
+        }
+        offset += size;
+    }
+    return true;
+#endif
+}
+
+/**
+ @brief Copy text replacing ill-formed utf-8 sequences with U+FFFD replacement character
+ 
+ Each maximal well-formed part of ill-formed sequence is replaced with one character.
+ Output must have space for 3 * length bytes.
+ 
+ @param[out] out Output buffer
+ @param[in] text Input text
+ @param[in] length Length of the text
+ @return Length of the output
+ */
+static size_t mobi_utf8_repair(unsigned char *out, const unsigned char *text, const size_t length) {
+    static const unsigned char replacement[] = { 0xef, 0xbf, 0xbd };
+    if (mobi_utf8_is_valid(text, length)) {
+        memcpy(out, text, length);
+        return length;
+    }
+    size_t out_length = 0;
+    size_t offset = 0;
+    while (offset < length) {
+        size_t size;
+        if (mobi_utf8_sequence(text + offset, length - offset, &size) == MOBI_UTF8_VALID) {
+            memcpy(out + out_length, text + offset, size);
+            out_length += size;
+        } else {
+            memcpy(out + out_length, replacement, sizeof(replacement));
+            out_length += sizeof(replacement);
+        }
+        offset += size;
+    }
+    return out_length;
+}
+
 /** @brief Get text encoding of mobi document
  
  @param[in] m MOBIData structure holding document data and metadata
@@ -494,6 +935,102 @@ MOBI_RET mobi_get_fullname(const MOBIData *m, char *fullname, const size_t len)
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief Get slot of the record uid in the records hash map
+ 
+ @param[in] uid Unique id
+ @param[in] map_size Number of slots in hash map, power of two
+ @return Initial slot for linear probing
+ */
+static size_t mobi_record_uid_slot(const size_t uid, const size_t map_size) {
+    /* Fibonacci hashing, uids are usually sequential even numbers */
+    return (size_t) ((uint32_t) uid * 2654435761U) & (map_size - 1);
+}
+
+/**
+ @brief Build hash map of records by uid from the records array of lookup tables
+ 
+ @param[in,out] index MOBIRecordIndex structure with filled records array
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_build_record_uidmap(MOBIRecordIndex *index) {
+    free(index->uid_map);
+    index->uid_map = NULL;
+    index->uid_map_size = 0;
+    if (index->count == 0) {
+        return MOBI_SUCCESS;
+    }
+    /* keep load factor at most 0.5 */
+    size_t map_size = 2;
+    while (map_size < 2 * index->count) {
+        map_size <<= 1;
+    }
+    MOBIPdbRecord **uid_map = calloc(map_size, sizeof(*uid_map));
+    if (uid_map == NULL) {
+        debug_print("%s", "Memory allocation for records index failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    for (size_t i = 0; i < index->count; i++) {
+        MOBIPdbRecord *rec = index->records[i];
+        size_t slot = mobi_record_uid_slot(rec->uid, map_size);
+        /* in case of duplicate uids first record wins */
+        while (uid_map[slot] != NULL && uid_map[slot]->uid != rec->uid) {
+            slot = (slot + 1) & (map_size - 1);
+        }
+        if (uid_map[slot] == NULL) {
+            uid_map[slot] = rec;
+        }
+    }
+    index->uid_map = uid_map;
+    index->uid_map_size = map_size;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Build lookup tables of records (array by sequential number and hash map by uid)
+ 
+ Tables are rebuilt in place if already present, so that they stay shared with the other part of hybrid file.
+ 
+ @param[in,out] m MOBIData structure with loaded list of records
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_build_record_index(MOBIData *m) {
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    if (m->rec_index == NULL) {
+        m->rec_index = calloc(1, sizeof(MOBIRecordIndex));
+        if (m->rec_index == NULL) {
+            debug_print("%s", "Memory allocation for records index failed\n");
+            return MOBI_MALLOC_FAILED;
+        }
+    }
+    MOBIRecordIndex *index = m->rec_index;
+    free(index->records);
+    index->records = NULL;
+    index->count = 0;
+    size_t count = 0;
+    const MOBIPdbRecord *curr = m->rec;
+    while (curr != NULL) {
+        count++;
+        curr = curr->next;
+    }
+    if (count > 0) {
+        index->records = malloc(count * sizeof(*index->records));
+        if (index->records == NULL) {
+            debug_print("%s", "Memory allocation for records index failed\n");
+            return MOBI_MALLOC_FAILED;
+        }
+        MOBIPdbRecord *rec = m->rec;
+        while (rec != NULL) {
+            index->records[index->count++] = rec;
+            rec = rec->next;
+        }
+    }
+    return mobi_build_record_uidmap(index);
+}
+
 /**
  @brief Get palm database record with given unique id
  
@@ -509,10 +1046,22 @@ MOBIPdbRecord * mobi_get_record_by_uid(const MOBIData *m, const size_t uid) {
     if (m->rec == NULL) {
         return NULL;
     }
+    const MOBIRecordIndex *index = m->rec_index;
+    if (index && index->uid_map) {
+        size_t slot = mobi_record_uid_slot(uid, index->uid_map_size);
+        while (index->uid_map[slot] != NULL) {
+            MOBIPdbRecord *curr = index->uid_map[slot];
+            if (curr->uid == uid) {
+                return mobi_load_recdata_lazy(m, curr) == MOBI_SUCCESS ? curr : NULL;
+            }
+            slot = (slot + 1) & (index->uid_map_size - 1);
+        }
+        return NULL;
+    }
     MOBIPdbRecord *curr = m->rec;
     while (curr != NULL) {
         if (curr->uid == uid) {
-            return curr;
+            return mobi_load_recdata_lazy(m, curr) == MOBI_SUCCESS ? curr : NULL;
         }
         curr = curr->next;
     }
@@ -636,17 +1185,158 @@ MOBIPdbRecord * mobi_get_record_by_seqnumber(const MOBIData *m, const size_t num
     if (m->rec == NULL) {
         return NULL;
     }
+    const MOBIRecordIndex *index = m->rec_index;
+    if (index && index->records) {
+        if (num >= index->count) {
+            return NULL;
+        }
+        MOBIPdbRecord *curr = index->records[num];
+        return mobi_load_recdata_lazy(m, curr) == MOBI_SUCCESS ? curr : NULL;
+    }
     MOBIPdbRecord *curr = m->rec;
     size_t i = 0;
     while (curr != NULL) {
         if (i++ == num) {
-            return curr;
+            return mobi_load_recdata_lazy(m, curr) == MOBI_SUCCESS ? curr : NULL;
         }
         curr = curr->next;
     }
     return NULL;
 }
 
+/**
+ @brief Get palm database record following given record
+ 
+ In lazy mode record data is read from file if needed.
+ 
+ @param[in] m MOBIData structure with loaded data
+ @param[in] record Current record
+ @return Pointer to next MOBIPdbRecord record structure, NULL if there are no more records or on failure
+ */
+MOBIPdbRecord * mobi_get_next_record(const MOBIData *m, const MOBIPdbRecord *record) {
+    if (record == NULL || record->next == NULL) {
+        return NULL;
+    }
+    MOBIPdbRecord *next = record->next;
+    return mobi_load_recdata_lazy(m, next) == MOBI_SUCCESS ? next : NULL;
+}
+
+/**
+ @brief Set number of threads used for text records decompression
+ 
+ With more than one thread, text records are decompressed concurrently by mobi_get_rawml() and mobi_dump_rawml().
+ Not available on Windows, where records are always decompressed sequentially.
+ 
+ @param[in,out] m MOBIData structure
+ @param[in] threads Number of threads, including the calling one (1 - sequential decompression, default)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_set_threads(MOBIData *m, const size_t threads) {
+    if (m == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    if (threads == 0) {
+        return MOBI_PARAM_ERR;
+    }
+    m->threads = threads;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Set memory limit for cache of expanded HUFF/CDIC symbols
+ 
+ Compressed dictionary symbols are expanded once and reused by huffman decompression.
+ Symbols are cached until the limit is reached, default is MOBI_HUFFCDIC_CACHE_SIZE.
+ HUFF/CDIC tables already kept in MOBIData are released, so the new limit applies to following calls.
+ Must not be called while text is being decompressed by other threads.
+ 
+ @param[in,out] m MOBIData structure
+ @param[in] size Memory limit in bytes (0 - cache disabled)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_set_huffcdic_cache(MOBIData *m, const size_t size) {
+    if (m == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    m->huff_cache_size = size;
+    mobi_free_huffcdic(m->huffcdic);
+    m->huffcdic = NULL;
+    if (m->next) {
+        mobi_free_huffcdic(m->next->huffcdic);
+        m->next->huffcdic = NULL;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Set memory limit for cache of decompressed text records
+ 
+ Cached records are reused by mobi_get_rawml(), mobi_dump_rawml(), mobi_get_text_range() and text reader.
+ Least recently used records are evicted when the limit is reached. Cache is disabled by default.
+ Must not be called while text is being decompressed by other threads.
+ 
+ @param[in,out] m MOBIData structure
+ @param[in] size Memory limit in bytes (0 - cache disabled)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_set_record_cache(MOBIData *m, const size_t size) {
+    if (m == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    mobi_free_record_cache(m->record_cache);
+    m->record_cache = NULL;
+    if (size) {
+        m->record_cache = mobi_init_record_cache(size);
+        if (m->record_cache == NULL) {
+            return MOBI_MALLOC_FAILED;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Get hit and miss counters of decompressed text records cache
+ 
+ @param[in] m MOBIData structure
+ @param[out] hits Number of records found in cache
+ @param[out] misses Number of records not found in cache
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_get_record_cache_stats(const MOBIData *m, size_t *hits, size_t *misses) {
+    if (m == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    if (hits == NULL || misses == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    *hits = 0;
+    *misses = 0;
+    MOBIRecordCache *cache = m->record_cache;
+    if (cache) {
+        *hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+        *misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Set loader to read records data from file on first access
+ 
+ Only records actually used are read into memory, file stays open until mobi_free() is called.
+ Applies to mobi_load_file() and mobi_load_filename(). Not available on Windows, where all records are read on load.
+ 
+ @param[in,out] m MOBIData structure
+ @param[in] lazy True to read records on demand, false (default) to read all records on load
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_lazy(MOBIData *m, const bool lazy) {
+    if (m == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    m->use_lazy = lazy;
+    return MOBI_SUCCESS;
+}
+
 /**
  @brief Delete palm database record with given sequential number from MOBIData structure
  
@@ -672,10 +1362,32 @@ MOBI_RET mobi_delete_record_by_seqnumber(MOBIData *m, const size_t num) {
             } else {
                 prev->next = curr->next;
             }
-            free(curr->data);
+            if (mobi_is_recdata_owned(m)) {
+                free(curr->data);
+            }
             curr->data = NULL;
             free(curr);
             curr = NULL;
+            /* cached huff/cdic tables may point to deleted record, text offsets and trailing entries may change */
+            mobi_free_huffcdic(m->huffcdic);
+            m->huffcdic = NULL;
+            free(m->text_offsets);
+            m->text_offsets = NULL;
+            free(m->trailing);
+            m->trailing = NULL;
+            /* sequential numbers of following records change */
+            mobi_clear_record_cache(m->record_cache);
+            if (m->next) {
+                mobi_free_huffcdic(m->next->huffcdic);
+                m->next->huffcdic = NULL;
+                free(m->next->text_offsets);
+                m->next->text_offsets = NULL;
+                free(m->next->trailing);
+                m->next->trailing = NULL;
+            }
+            if (m->rec_index) {
+                return mobi_build_record_index(m);
+            }
             return MOBI_SUCCESS;
         }
         prev = curr;
@@ -842,20 +1554,22 @@ char * mobi_decode_exthstring(const MOBIData *m, const unsigned char *data, cons
     if (!m || !data) {
         return NULL;
     }
-    size_t out_length = 3 * size + 1;
-    size_t in_length = size;
-    char string[out_length];
-    if (mobi_is_cp1252(m)) {
-        MOBI_RET ret = mobi_cp1252_to_utf8(string, (const char *) data, &out_length, in_length);
+    const bool cp1252 = mobi_is_cp1252(m);
+    size_t out_length = cp1252 ? mobi_cp1252_to_utf8_length((const char *) data, size) + 1 : size + 1;
+    char *exth_string = malloc(out_length);
+    if (exth_string == NULL) {
+        return NULL;
+    }
+    if (cp1252) {
+        MOBI_RET ret = mobi_cp1252_to_utf8(exth_string, (const char *) data, &out_length, size);
         if (ret != MOBI_SUCCESS) {
+            free(exth_string);
             return NULL;
         }
     } else {
-        memcpy(string, data, size);
-        out_length = size;
+        memcpy(exth_string, data, size);
+        exth_string[size] = '\0';
     }
-    string[out_length] = '\0';
-    char *exth_string = strdup(string);
     return exth_string;
 }
 
@@ -910,12 +1624,425 @@ int mobi_bitcount(const uint8_t byte) {
 }
 
 /**
- @brief Decompress text record (internal).
+ @brief Get HUFF/CDIC tables of the document, parsing them on first use
  
- Internal function for mobi_get_rawml and mobi_dump_rawml. 
- Decompressed output is stored either in a file or in a text string
+ Tables are stored in MOBIData and reused by following calls, they are released by mobi_free().
+ Concurrent calls are safe, tables parsed by the thread that lost the race are discarded.
  
- @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] m MOBIData structure with loaded MOBI document
+ @param[out] huffcdic Parsed tables, read-only and shared by all callers
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_get_huffcdic(const MOBIData *m, const MOBIHuffCdic **huffcdic) {
+    /* tables are a cache, not document data, so they may be attached to const MOBIData */
+    MOBIHuffCdic **cached = (MOBIHuffCdic **) &m->huffcdic;
+    MOBIHuffCdic *current = __atomic_load_n(cached, __ATOMIC_ACQUIRE);
+    if (current == NULL) {
+        MOBIHuffCdic *parsed = mobi_init_huffcdic();
+        if (parsed == NULL) {
+            return MOBI_MALLOC_FAILED;
+        }
+        const MOBI_RET ret = mobi_parse_huffdic(m, parsed);
+        if (ret != MOBI_SUCCESS) {
+            mobi_free_huffcdic(parsed);
+            return ret;
+        }
+        if (__atomic_compare_exchange_n(cached, &current, parsed, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            current = parsed;
+        } else {
+            /* other thread parsed tables in the meantime */
+            mobi_free_huffcdic(parsed);
+        }
+    }
+    *huffcdic = current;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Lock the records cache
+ 
+ @param[in,out] cache MOBIRecordCache structure
+ */
+static void mobi_record_cache_lock(MOBIRecordCache *cache) {
+#ifndef _WIN32
+    pthread_mutex_lock(&cache->lock);
+#else
+    while (__atomic_test_and_set(&cache->lock, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&cache->lock, __ATOMIC_RELAXED)) {}
+    }
+#endif
+}
+
+/**
+ @brief Unlock the records cache
+ 
+ @param[in,out] cache MOBIRecordCache structure
+ */
+static void mobi_record_cache_unlock(MOBIRecordCache *cache) {
+#ifndef _WIN32
+    pthread_mutex_unlock(&cache->lock);
+#else
+    __atomic_clear(&cache->lock, __ATOMIC_RELEASE);
+#endif
+}
+
+/**
+ @brief Unlink entry from the list of recently used records
+ 
+ @param[in,out] cache MOBIRecordCache structure
+ @param[in,out] entry Cached entry
+ */
+static void mobi_record_cache_unlink(MOBIRecordCache *cache, MOBIRecordCacheEntry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+/**
+ @brief Insert entry at the front of the list of recently used records
+ 
+ @param[in,out] cache MOBIRecordCache structure
+ @param[in,out] entry Entry not linked in the list
+ */
+static void mobi_record_cache_push(MOBIRecordCache *cache, MOBIRecordCacheEntry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+/**
+ @brief Copy decompressed record from cache
+ 
+ @param[in,out] cache MOBIRecordCache structure
+ @param[in] seqnumber Sequential number of the record
+ @param[out] out Memory area of RECORD0_TEXT_SIZE_MAX bytes for decompressed output
+ @param[out] out_size Size of decompressed data
+ @return True if record was found in cache, false otherwise
+ */
+static bool mobi_record_cache_get(MOBIRecordCache *cache, const size_t seqnumber, unsigned char *out, size_t *out_size) {
+    bool found = false;
+    mobi_record_cache_lock(cache);
+    if (seqnumber < cache->entries_count && cache->entries[seqnumber]) {
+        MOBIRecordCacheEntry *entry = cache->entries[seqnumber];
+        memcpy(out, entry->data, entry->size);
+        *out_size = entry->size;
+        mobi_record_cache_unlink(cache, entry);
+        mobi_record_cache_push(cache, entry);
+        cache->hits++;
+        found = true;
+    } else {
+        cache->misses++;
+    }
+    mobi_record_cache_unlock(cache);
+    return found;
+}
+
+/**
+ @brief Store decompressed record in cache, evicting least recently used records if needed
+ 
+ Only records decompressed without errors may be stored, cached data is served as is.
+ Failures are not reported, record is just not cached.
+ 
+ @param[in,out] cache MOBIRecordCache structure
+ @param[in] seqnumber Sequential number of the record
+ @param[in] data Decompressed data
+ @param[in] size Size of decompressed data
+ */
+static void mobi_record_cache_put(MOBIRecordCache *cache, const size_t seqnumber, const unsigned char *data, const size_t size) {
+    if (size > cache->limit) {
+        return;
+    }
+    /* entry is prepared before taking the lock */
+    MOBIRecordCacheEntry *entry = malloc(sizeof(MOBIRecordCacheEntry) + size);
+    if (entry == NULL) {
+        return;
+    }
+    entry->seqnumber = seqnumber;
+    entry->size = size;
+    entry->data = (unsigned char *) (entry + 1);
+    memcpy(entry->data, data, size);
+    /* allocations and frees are done outside of the lock */
+    MOBIRecordCacheEntry **entries = NULL;
+    mobi_record_cache_lock(cache);
+    while (seqnumber >= cache->entries_count) {
+        size_t count = cache->entries_count ? 2 * cache->entries_count : 256;
+        while (seqnumber >= count) {
+            count *= 2;
+        }
+        mobi_record_cache_unlock(cache);
+        free(entries);
+        entries = calloc(count, sizeof(*entries));
+        if (entries == NULL) {
+            free(entry);
+            return;
+        }
+        mobi_record_cache_lock(cache);
+        if (count > cache->entries_count) {
+            /* array may have been grown by other thread in the meantime */
+            if (cache->entries_count) {
+                memcpy(entries, cache->entries, cache->entries_count * sizeof(*entries));
+            }
+            MOBIRecordCacheEntry **old_entries = cache->entries;
+            cache->entries = entries;
+            cache->entries_count = count;
+            entries = old_entries;
+        }
+    }
+    MOBIRecordCacheEntry *evicted = NULL;
+    if (cache->entries[seqnumber]) {
+        /* other thread stored the record in the meantime */
+        evicted = entry;
+        evicted->next = NULL;
+    } else {
+        while (cache->size + size > cache->limit && cache->tail) {
+            MOBIRecordCacheEntry *last = cache->tail;
+            mobi_record_cache_unlink(cache, last);
+            cache->entries[last->seqnumber] = NULL;
+            cache->size -= last->size;
+            last->next = evicted;
+            evicted = last;
+        }
+        cache->entries[seqnumber] = entry;
+        cache->size += size;
+        mobi_record_cache_push(cache, entry);
+    }
+    mobi_record_cache_unlock(cache);
+    free(entries);
+    while (evicted) {
+        MOBIRecordCacheEntry *next = evicted->next;
+        free(evicted);
+        evicted = next;
+    }
+}
+
+/**
+ @brief Get text of single text record, decompressing it if needed
+ 
+ Text of uncompressed records is not copied, returned text points to the record data.
+ Compressed records are decompressed into the output area, which may be a part of the caller's final buffer.
+ If records cache is enabled, compressed record is looked up in cache first and stored there after successful decompression.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] seqnumber Sequential number of the record
+ @param[in] record Text record
+ @param[out] out Memory area of RECORD0_TEXT_SIZE_MAX bytes for decompressed output, bytes past decompressed data may be overwritten
+ @param[out] text Text of the record, either record data or out
+ @param[out] text_size Size of the text
+ @param[in] compression_type Compression type from Record 0 header
+ @param[in] trailing Parsed trailing entries of the record or NULL if record has none
+ @param[in] huffcdic MOBIHuffCdic structure with parsed huff/cdic tables or NULL
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_decompress_record(const MOBIData *m, const size_t seqnumber, const MOBIPdbRecord *record, unsigned char *out, const unsigned char **text, size_t *text_size, const uint16_t compression_type, const MOBITrailingEntries *trailing, const MOBIHuffCdic *huffcdic) {
+    size_t record_size = record->size;
+    if (trailing) {
+        if (trailing->text_size == 0) {
+            return MOBI_DATA_CORRUPT;
+        }
+        record_size = trailing->text_size;
+    }
+    if (compression_type == RECORD0_NO_COMPRESSION) {
+        /* no compression, record data is used in place */
+        if (record_size > RECORD0_TEXT_SIZE_MAX) {
+            debug_print("Text record too long (%zu)\n", record_size);
+            return MOBI_DATA_CORRUPT;
+        }
+        *text = record->data;
+        *text_size = record_size;
+        return MOBI_SUCCESS;
+    }
+    *text = out;
+    MOBIRecordCache *cache = m->record_cache;
+    if (cache && mobi_record_cache_get(cache, seqnumber, out, text_size)) {
+        return MOBI_SUCCESS;
+    }
+    /* FIXME: RECORD0_TEXT_SIZE_MAX should be enough */
+    *text_size = RECORD0_TEXT_SIZE_MAX;
+    MOBI_RET ret;
+    switch (compression_type) {
+        case RECORD0_PALMDOC_COMPRESSION:
+            /* palmdoc lz77 compression */
+            ret = mobi_decompress_lz77(out, record->data, text_size, record_size);
+            break;
+        case RECORD0_HUFF_COMPRESSION:
+            /* mobi huffman compression */
+            ret = mobi_decompress_huffman(out, record->data, text_size, record_size, huffcdic);
+            break;
+        default:
+            debug_print("%s", "Unknown compression type\n");
+            return MOBI_DATA_CORRUPT;
+    }
+    if (ret != MOBI_SUCCESS) {
+        debug_print("Decompression of text record %zu failed\n", seqnumber);
+        /* failed or truncated output must not be cached */
+        return ret;
+    }
+    if (cache) {
+        mobi_record_cache_put(cache, seqnumber, out, *text_size);
+    }
+    return MOBI_SUCCESS;
+}
+
+#ifndef _WIN32
+/**
+ @brief Shared state of threads decompressing text records
+ */
+typedef struct {
+    const MOBIPdbRecord **records; /**< Text records */
+    size_t count; /**< Number of text records */
+    size_t next; /**< Index of the next record to be decompressed, updated atomically */
+    unsigned char *out; /**< Output area, RECORD0_TEXT_SIZE_MAX bytes per record, may be the caller's text buffer */
+    size_t *sizes; /**< Decompressed size of each record */
+    MOBI_RET *rets; /**< Status of each record */
+    uint16_t compression_type; /**< Compression type from Record 0 header */
+    const MOBITrailingEntries *trailing; /**< Parsed trailing entries of text records or NULL */
+    const MOBIHuffCdic *huffcdic; /**< Parsed huff/cdic tables or NULL */
+    const MOBIData *m; /**< MOBIData structure loaded with MOBI data */
+    size_t first; /**< Sequential number of the first text record */
+} MOBIDecompressJob;
+
+/**
+ @brief Thread routine decompressing text records until none is left
+ 
+ @param[in,out] arg MOBIDecompressJob structure
+ @return NULL
+ */
+static void * mobi_decompress_worker(void *arg) {
+    MOBIDecompressJob *job = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        /* compressed records only, text is always stored in the output slot */
+        const unsigned char *text;
+        job->rets[i] = mobi_decompress_record(job->m, job->first + i, job->records[i], job->out + i * RECORD0_TEXT_SIZE_MAX, &text, &job->sizes[i],
+                                              job->compression_type, job->trailing ? &job->trailing[i] : NULL, job->huffcdic);
+    }
+    return NULL;
+}
+
+/**
+ @brief Decompress text records concurrently and assemble output in order
+ 
+ Each record is decompressed into its own slot, output offsets are calculated from decompressed sizes.
+ If text buffer is large enough to hold all slots, records are decompressed straight into it
+ and moved down to their final offsets afterwards, otherwise a separate output area is allocated.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] first Sequential number of the first text record
+ @param[in] count Number of text records
+ @param[in] compression_type Compression type from Record 0 header
+ @param[in] trailing Parsed trailing entries of text records or NULL
+ @param[in] huffcdic MOBIHuffCdic structure with parsed huff/cdic tables or NULL
+ @param[in,out] text Memory area to be filled with decompressed output
+ @param[in,out] file If not NULL output is written to the file, otherwise to text string
+ @param[in,out] len Length of the memory allocated for the text string, on return set to decompressed text length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_decompress_content_parallel(const MOBIData *m, const size_t first, size_t count, const uint16_t compression_type, const MOBITrailingEntries *trailing, const MOBIHuffCdic *huffcdic, char *text, FILE *file, size_t *len) {
+    const bool in_place = (file == NULL && *len >= count * RECORD0_TEXT_SIZE_MAX);
+    MOBIDecompressJob job = {
+        .records = malloc(count * sizeof(*job.records)),
+        .out = in_place ? (unsigned char *) text : malloc(count * RECORD0_TEXT_SIZE_MAX),
+        .sizes = malloc(count * sizeof(*job.sizes)),
+        .rets = malloc(count * sizeof(*job.rets)),
+        .compression_type = compression_type,
+        .trailing = trailing,
+        .huffcdic = huffcdic,
+        .m = m,
+        .first = first,
+        .next = 0
+    };
+    size_t threads_count = min(m->threads, count) - 1;
+    pthread_t *threads = malloc((threads_count ? threads_count : 1) * sizeof(pthread_t));
+    MOBI_RET ret = MOBI_SUCCESS;
+    if (job.records == NULL || job.out == NULL || job.sizes == NULL || job.rets == NULL || threads == NULL) {
+        debug_print("%s", "Memory allocation for text decompression failed\n");
+        ret = MOBI_MALLOC_FAILED;
+        goto cleanup;
+    }
+    /* records are collected in current thread, so that lazy loading is not done concurrently */
+    job.count = 0;
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, first);
+    while (count-- && curr) {
+        job.records[job.count++] = curr;
+        curr = count ? mobi_get_next_record(m, curr) : NULL;
+    }
+    size_t started = 0;
+    while (started < threads_count) {
+        if (pthread_create(&threads[started], NULL, mobi_decompress_worker, &job) != 0) {
+            debug_print("%s", "Creating decompression thread failed\n");
+            break;
+        }
+        started++;
+    }
+    /* current thread also takes part */
+    mobi_decompress_worker(&job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    size_t text_length = 0;
+    for (size_t i = 0; i < job.count; i++) {
+        if (job.rets[i] != MOBI_SUCCESS) {
+            ret = job.rets[i];
+            goto cleanup;
+        }
+        text_length += job.sizes[i];
+    }
+    if (file == NULL && text_length > *len) {
+        debug_print("%s", "Text buffer too small\n");
+        ret = MOBI_PARAM_ERR;
+        goto cleanup;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < job.count; i++) {
+        const unsigned char *decompressed = job.out + i * RECORD0_TEXT_SIZE_MAX;
+        if (file) {
+            fwrite(decompressed, 1, job.sizes[i], file);
+        } else if ((unsigned char *) text + offset != decompressed) {
+            /* in place: final offset never exceeds slot offset, so preceding slots are already moved */
+            memmove(text + offset, decompressed, job.sizes[i]);
+        }
+        offset += job.sizes[i];
+    }
+    if (file == NULL) {
+        text[text_length] = '\0';
+    }
+    if (len) {
+        *len = text_length;
+    }
+cleanup:
+    free(job.records);
+    if (!in_place) {
+        free(job.out);
+    }
+    free(job.sizes);
+    free(job.rets);
+    free(threads);
+    return ret;
+}
+#endif
+
+/**
+ @brief Decompress text record (internal).
+ 
+ Internal function for mobi_get_rawml and mobi_dump_rawml. 
+ Decompressed output is stored either in a file or in a text string.
+ If more than one thread is set with mobi_set_threads(), records are decompressed concurrently.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
  @param[in,out] text Memory area to be filled with decompressed output
  @param[in,out] file If not NULL output is written to the file, otherwise to text string
  @param[in,out] len Length of the memory allocated for the text string, on return set to decompressed text length
@@ -943,78 +2070,60 @@ static MOBI_RET mobi_decompress_content(const MOBIData *m, char *text, FILE *fil
     size_t text_rec_count = m->rh->text_record_count;
     const uint16_t compression_type = m->rh->compression_type;
     /* check for extra data at the end of text files */
-    uint16_t extra_flags = 0;
-    if (m->mh && m->mh->extra_flags) {
-        extra_flags = *m->mh->extra_flags;
+    const MOBITrailingEntries *trailing = NULL;
+    const MOBI_RET trailing_ret = mobi_get_trailing_entries(m, &trailing);
+    if (trailing_ret != MOBI_SUCCESS) {
+        return trailing_ret;
     }
     /* get first text record */
     const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, text_rec_index);
-    MOBIHuffCdic *huffcdic = NULL;
+    const MOBIHuffCdic *huffcdic = NULL;
     if (compression_type == RECORD0_HUFF_COMPRESSION) {
         /* load huff/cdic tables */
-        huffcdic = mobi_init_huffcdic();
-        if (huffcdic == NULL) {
-            return MOBI_MALLOC_FAILED;
-        }
-        MOBI_RET ret = mobi_parse_huffdic(m, huffcdic);
+        MOBI_RET ret = mobi_get_huffcdic(m, &huffcdic);
         if (ret != MOBI_SUCCESS) {
-            free(huffcdic);
             return ret;
         }
     }
+#ifndef _WIN32
+    if (m->threads > 1 && text_rec_count > 1 && compression_type != RECORD0_NO_COMPRESSION) {
+        return mobi_decompress_content_parallel(m, text_rec_index, text_rec_count, compression_type, trailing, huffcdic, text, file, len);
+    }
+#endif
     /* get following CDIC records */
     size_t text_length = 0;
+    size_t seqnumber = text_rec_index;
+    /* used only for file output and for the last records if text buffer has less than RECORD0_TEXT_SIZE_MAX bytes left */
+    unsigned char bounce[RECORD0_TEXT_SIZE_MAX];
     while (text_rec_count-- && curr) {
-        size_t extra_size = 0;
-        if (extra_flags) {
-            extra_size = mobi_get_record_extrasize(curr, extra_flags);
-            if (extra_size == MOBI_NOTSET || extra_size >= curr->size) {
-                return MOBI_DATA_CORRUPT;
-            }
+        unsigned char *out = bounce;
+        if (!dump && *len - text_length >= RECORD0_TEXT_SIZE_MAX) {
+            /* decompress straight to the final offset */
+            out = (unsigned char *) text + text_length;
         }
-        const size_t record_size = curr->size - extra_size;
-        unsigned char decompressed[RECORD0_TEXT_SIZE_MAX];
-        /* FIXME: RECORD0_TEXT_SIZE_MAX should be enough */
-        size_t decompressed_size = RECORD0_TEXT_SIZE_MAX;
-        switch (compression_type) {
-            case RECORD0_NO_COMPRESSION:
-                /* no compression */
-                memcpy(decompressed, curr->data, curr->size);
-                decompressed_size = curr->size;
-                break;
-            case RECORD0_PALMDOC_COMPRESSION:
-                /* palmdoc lz77 compression */
-                mobi_decompress_lz77(decompressed, curr->data, &decompressed_size, record_size);
-                break;
-            case RECORD0_HUFF_COMPRESSION:
-                /* mobi huffman compression */
-                mobi_decompress_huffman(decompressed, curr->data, &decompressed_size, record_size, huffcdic);
-                break;
-            default:
-                debug_print("%s", "Unknown compression type\n");
-                return MOBI_DATA_CORRUPT;
+        const unsigned char *decompressed;
+        size_t decompressed_size;
+        const MOBITrailingEntries *record_trailing = trailing ? &trailing[seqnumber - text_rec_index] : NULL;
+        const MOBI_RET ret = mobi_decompress_record(m, seqnumber++, curr, out, &decompressed, &decompressed_size, compression_type, record_trailing, huffcdic);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
         }
-        curr = curr->next;
+        curr = text_rec_count ? mobi_get_next_record(m, curr) : NULL;
         if (dump) {
             fwrite(decompressed, 1, decompressed_size, file);
         } else {
-            if (text_length > *len) {
+            if (decompressed_size > *len - text_length) {
                 debug_print("%s", "Text buffer too small\n");
-                /* free huff/cdic tables */
-                if (compression_type == RECORD0_HUFF_COMPRESSION) {
-                    mobi_free_huffcdic(huffcdic);
-                }
                 return MOBI_PARAM_ERR;
             }
-            memcpy(text + text_length, decompressed, decompressed_size);
+            if (decompressed != (unsigned char *) text + text_length) {
+                memcpy(text + text_length, decompressed, decompressed_size);
+            }
             text_length += decompressed_size;
-            text[text_length] = '\0';
         }
-
     }
-    /* free huff/cdic tables */
-    if (compression_type == RECORD0_HUFF_COMPRESSION) {
-        mobi_free_huffcdic(huffcdic);
+    if (!dump) {
+        text[text_length] = '\0';
     }
     if (len) {
         *len = text_length;
@@ -1027,7 +2136,8 @@ static MOBI_RET mobi_decompress_content(const MOBIData *m, char *text, FILE *fil
  
  @param[in] m MOBIData structure loaded with MOBI data
  @param[in,out] text Memory area to be filled with decompressed output
- @param[in,out] len Length of the memory allocated for the text string, on return will be set to decompressed text length
+ @param[in,out] len Length of the memory allocated for the text string, not counting terminating null character,
+ on return will be set to decompressed text length
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
 MOBI_RET mobi_get_rawml(const MOBIData *m, char *text, size_t *len) {
@@ -1057,6 +2167,1051 @@ MOBI_RET mobi_dump_rawml(const MOBIData *m, FILE *file) {
     return mobi_decompress_content(m, NULL, file, NULL);
 }
 
+/**
+ @brief Open reader returning decompressed text one record at a time
+ 
+ Unlike mobi_get_rawml(), text does not have to fit in memory at once.
+ Reader uses a constant amount of memory, regardless of the document size.
+ Reader structure is usually allocated by the caller on the stack, it must be released with mobi_text_reader_close().
+ 
+ @param[out] reader MOBITextReader structure to be initialized
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] flags MOBITextFlags: MOBI_TEXT_UTF8 to convert cp1252 text to utf-8,
+ MOBI_TEXT_VALIDATE or MOBI_TEXT_REPAIR to check text of utf-8 documents, MOBI_TEXT_RAW otherwise
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_text_reader_open(MOBITextReader *reader, const MOBIData *m, const int flags) {
+    if (reader == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    memset(reader, 0, sizeof(MOBITextReader));
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    if (mobi_is_encrypted(m)) {
+        debug_print("%s", "Document is encrypted\n");
+        return MOBI_FILE_ENCRYPTED;
+    }
+    if (m->rh == NULL || m->rh->text_record_count == 0) {
+        debug_print("%s", "Text records not found in MOBI header\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    reader->m = m;
+    reader->remaining = m->rh->text_record_count;
+    reader->compression_type = m->rh->compression_type;
+    /* check for extra data at the end of text files */
+    const MOBI_RET trailing_ret = mobi_get_trailing_entries(m, &reader->trailing);
+    if (trailing_ret != MOBI_SUCCESS) {
+        return trailing_ret;
+    }
+    if (reader->compression_type == RECORD0_HUFF_COMPRESSION) {
+        /* load huff/cdic tables */
+        const MOBI_RET ret = mobi_get_huffcdic(m, &reader->huffcdic);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    reader->data = malloc(RECORD0_TEXT_SIZE_MAX + 1);
+    if (reader->data == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    /* conversion is decided on the first record, replica text is never converted */
+    reader->convert = (flags & MOBI_TEXT_UTF8) && mobi_is_cp1252(m);
+    if (reader->convert) {
+        /* extreme case in which each input character is converted to 3-byte utf-8 sequence */
+        reader->text = malloc(3 * RECORD0_TEXT_SIZE_MAX + 1);
+        if (reader->text == NULL) {
+            debug_print("%s", "Memory allocation failed\n");
+            mobi_text_reader_close(reader);
+            return MOBI_MALLOC_FAILED;
+        }
+    }
+    /* text converted from cp1252 is always valid, only utf-8 encoded documents are checked */
+    if (!mobi_is_cp1252(m)) {
+        if (flags & MOBI_TEXT_REPAIR) {
+            reader->check = MOBI_TEXT_REPAIR;
+            /* extreme case in which each byte, including incomplete sequence from the previous record, is replaced */
+            reader->repaired = malloc(3 * (RECORD0_TEXT_SIZE_MAX + sizeof(reader->tail)));
+            if (reader->repaired == NULL) {
+                debug_print("%s", "Memory allocation failed\n");
+                mobi_text_reader_close(reader);
+                return MOBI_MALLOC_FAILED;
+            }
+        } else if (flags & MOBI_TEXT_VALIDATE) {
+            reader->check = MOBI_TEXT_VALIDATE;
+        }
+    }
+    /* get first text record */
+    reader->record = mobi_get_record_by_seqnumber(m, 1 + mobi_get_kf8offset(m));
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Decompress current text record of the reader and move to the following one
+ 
+ Text of uncompressed records points to the record data, otherwise it is stored in reader data.
+ 
+ @param[in,out] reader MOBITextReader structure with a record left to read
+ @param[out] text Text of the record
+ @param[out] size Size of the text
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_text_reader_read(MOBITextReader *reader, const unsigned char **text, size_t *size) {
+    const size_t index = reader->m->rh->text_record_count - reader->remaining;
+    const size_t seqnumber = 1 + mobi_get_kf8offset(reader->m) + index;
+    const MOBITrailingEntries *trailing = reader->trailing ? &reader->trailing[index] : NULL;
+    const MOBI_RET ret = mobi_decompress_record(reader->m, seqnumber, reader->record, reader->data, text, size, reader->compression_type, trailing, reader->huffcdic);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    reader->remaining--;
+    reader->record = reader->remaining ? mobi_get_next_record(reader->m, reader->record) : NULL;
+    if (*text == reader->data) {
+        reader->data[*size] = '\0';
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Move reader to the text record with given index
+ 
+ @param[in,out] reader MOBITextReader structure initialized with mobi_text_reader_open()
+ @param[in] index Index of the text record, counted from the first text record
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_text_reader_seek(MOBITextReader *reader, const size_t index) {
+    const size_t count = reader->m->rh->text_record_count;
+    if (index >= count) {
+        return MOBI_PARAM_ERR;
+    }
+    const size_t seqnumber = 1 + mobi_get_kf8offset(reader->m) + index;
+    MOBIPdbRecord *record = mobi_get_record_by_seqnumber(reader->m, seqnumber);
+    if (record == NULL) {
+        debug_print("Text record %zu not found\n", seqnumber);
+        return MOBI_DATA_CORRUPT;
+    }
+    reader->record = record;
+    reader->remaining = count - index;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Check utf-8 text of the current record, continuing incomplete sequence from the previous record
+ 
+ In MOBI_TEXT_VALIDATE mode text is not changed. In MOBI_TEXT_REPAIR mode text is replaced with its repaired copy
+ and incomplete sequence at the end of the record is held back until the following record is read.
+ 
+ @param[in,out] reader MOBITextReader structure with check mode set
+ @param[in,out] text Text of the record, replaced in MOBI_TEXT_REPAIR mode
+ @param[in,out] size Size of the text
+ @return MOBI_RET status code (MOBI_DATA_CORRUPT if text is malformed in MOBI_TEXT_VALIDATE mode)
+ */
+static MOBI_RET mobi_text_reader_check(MOBITextReader *reader, const unsigned char **text, size_t *size) {
+    const unsigned char *in = *text;
+    const size_t length = *size;
+    const bool repair = (reader->check == MOBI_TEXT_REPAIR);
+    unsigned char *out = (unsigned char *) reader->repaired;
+    size_t out_length = 0;
+    size_t start = 0;
+    if (reader->tail_size) {
+        /* complete sequence started in the previous record, its beginning is known to be well-formed */
+        unsigned char sequence[4];
+        const size_t tail_size = reader->tail_size;
+        const size_t count = min(length, sizeof(sequence) - tail_size);
+        memcpy(sequence, reader->tail, tail_size);
+        memcpy(sequence + tail_size, in, count);
+        size_t sequence_size;
+        const MOBIUtf8Sequence result = mobi_utf8_sequence(sequence, tail_size + count, &sequence_size);
+        if (result == MOBI_UTF8_INCOMPLETE) {
+            /* whole record is still a part of the sequence */
+            memcpy(reader->tail + tail_size, in, length);
+            reader->tail_size += length;
+            if (repair) {
+                *size = 0;
+            }
+            return MOBI_SUCCESS;
+        }
+        if (result == MOBI_UTF8_INVALID && !repair) {
+            debug_print("%s", "Malformed utf-8 sequence between text records\n");
+            return MOBI_DATA_CORRUPT;
+        }
+        if (repair) {
+            out_length = mobi_utf8_repair(out, sequence, sequence_size);
+        }
+        start = sequence_size - tail_size;
+        reader->tail_size = 0;
+    }
+    /* incomplete sequence at the end of the record is checked together with the following record */
+    size_t end = length;
+    for (size_t i = 1; i <= sizeof(reader->tail) && i <= length - start; i++) {
+        const unsigned char c = in[length - i];
+        if (c < 0x80) {
+            break;
+        }
+        if (c >= 0xc0) {
+            size_t sequence_size;
+            if (mobi_utf8_sequence(in + length - i, i, &sequence_size) == MOBI_UTF8_INCOMPLETE) {
+                end = length - i;
+            }
+            break;
+        }
+    }
+    if (repair) {
+        out_length += mobi_utf8_repair(out + out_length, in + start, end - start);
+        *text = out;
+        *size = out_length;
+    } else if (!mobi_utf8_is_valid(in + start, end - start)) {
+        debug_print("%s", "Malformed utf-8 text\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    memcpy(reader->tail, in + end, length - end);
+    reader->tail_size = length - end;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Get decompressed text of the next text record
+ 
+ Returned text stays valid until the next call or mobi_text_reader_close().
+ Text of uncompressed documents read without conversion points directly to the record data
+ and is not null terminated, use returned length.
+ In MOBI_TEXT_VALIDATE mode MOBI_DATA_CORRUPT is returned as soon as malformed utf-8 text is found.
+ In MOBI_TEXT_REPAIR mode malformed sequences are replaced with U+FFFD, utf-8 sequence split between records
+ is returned whole with the following record.
+ Records without text are skipped, so zero length is returned only at the end of the text.
+ 
+ @param[in,out] reader MOBITextReader structure initialized with mobi_text_reader_open()
+ @param[out] text Decompressed text, NULL at the end of the text
+ @param[out] len Length of the text, 0 at the end of the text
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_text_reader_next(MOBITextReader *reader, const char **text, size_t *len) {
+    if (reader == NULL || text == NULL || len == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    *text = NULL;
+    *len = 0;
+    if (reader->data == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    while (*len == 0 && reader->remaining && reader->record) {
+        const bool first = (reader->remaining == reader->m->rh->text_record_count);
+        const unsigned char *data;
+        size_t size;
+        const MOBI_RET ret = mobi_text_reader_read(reader, &data, &size);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        if (first && size >= 4 && memcmp(data, REPLICA_MAGIC, 4) == 0) {
+            /* replica text is neither converted nor checked */
+            free(reader->text);
+            reader->text = NULL;
+            reader->check = 0;
+        }
+        if (reader->text == NULL) {
+            if (reader->check) {
+                const MOBI_RET check_ret = mobi_text_reader_check(reader, &data, &size);
+                if (check_ret != MOBI_SUCCESS) {
+                    return check_ret;
+                }
+            }
+            *text = (const char *) data;
+            *len = size;
+            continue;
+        }
+        const unsigned char *end = memchr(data, '\0', size);
+        if (end) {
+            /* conversion stops on null character, same as conversion of the whole text */
+            size = (size_t) (end - data);
+            reader->remaining = 0;
+            reader->record = NULL;
+        }
+        size_t out_length = 3 * RECORD0_TEXT_SIZE_MAX + 1;
+        const MOBI_RET conv_ret = mobi_cp1252_to_utf8(reader->text, (const char *) data, &out_length, size);
+        if (conv_ret != MOBI_SUCCESS) {
+            return conv_ret;
+        }
+        *text = reader->text;
+        *len = out_length;
+    }
+    if (*len == 0 && reader->tail_size) {
+        /* text ends with incomplete utf-8 sequence */
+        if (reader->check == MOBI_TEXT_VALIDATE) {
+            debug_print("%s", "Text ends with incomplete utf-8 sequence\n");
+            return MOBI_DATA_CORRUPT;
+        }
+        *text = reader->repaired;
+        *len = mobi_utf8_repair((unsigned char *) reader->repaired, reader->tail, reader->tail_size);
+        reader->tail_size = 0;
+    }
+    if (*len == 0) {
+        *text = NULL;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Release memory held by MOBITextReader structure
+ 
+ Structure itself is not freed, it is usually allocated by the caller on the stack.
+ 
+ @param[in,out] reader MOBITextReader structure
+ */
+void mobi_text_reader_close(MOBITextReader *reader) {
+    if (reader == NULL) {
+        return;
+    }
+    free(reader->data);
+    free(reader->text);
+    free(reader->repaired);
+    reader->data = NULL;
+    reader->text = NULL;
+    reader->repaired = NULL;
+    reader->tail_size = 0;
+    reader->record = NULL;
+    reader->remaining = 0;
+}
+
+/**
+ @brief Decompress text of the document into newly allocated utf-8 encoded string
+ 
+ Text of cp1252 encoded documents is converted record by record while decompressed data is still in cache,
+ straight into a single output buffer, which is grown only if converted text exceeds the raw text size.
+ Conversion stops on the first null character, replica text is never converted.
+ If more than one thread is set with mobi_set_threads(), whole text is decompressed concurrently first
+ and converted afterwards.
+ Returned string is null terminated and must be freed by the caller.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[out] text Decompressed and converted text
+ @param[out] len Length of the text
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_get_rawml_utf8(const MOBIData *m, char **text, size_t *len) {
+    if (m == NULL || text == NULL || len == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    *text = NULL;
+    *len = 0;
+    /* Get maximal size of text data */
+    const size_t maxlen = mobi_get_text_maxsize(m);
+    if (maxlen == MOBI_NOTSET) {
+        debug_print("%s", "Text records not found in MOBI header\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    size_t capacity = maxlen + 1;
+    char *out = malloc(capacity);
+    if (out == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    size_t length = maxlen;
+    MOBI_RET ret;
+    if (!mobi_is_cp1252(m) || m->threads > 1) {
+        ret = mobi_get_rawml(m, out, &length);
+        if (ret != MOBI_SUCCESS) {
+            free(out);
+            return ret;
+        }
+        if (mobi_is_cp1252(m) && (length < 4 || memcmp(out, REPLICA_MAGIC, 4) != 0)) {
+            size_t out_length = mobi_cp1252_to_utf8_length(out, length) + 1;
+            char *out_text = malloc(out_length);
+            if (out_text == NULL) {
+                debug_print("%s", "Memory allocation failed\n");
+                free(out);
+                return MOBI_MALLOC_FAILED;
+            }
+            ret = mobi_cp1252_to_utf8(out_text, out, &out_length, length);
+            free(out);
+            if (ret != MOBI_SUCCESS) {
+                free(out_text);
+                return ret;
+            }
+            out = out_text;
+            length = out_length;
+        }
+        *text = out;
+        *len = length;
+        return MOBI_SUCCESS;
+    }
+    MOBITextReader reader;
+    ret = mobi_text_reader_open(&reader, m, MOBI_TEXT_RAW);
+    if (ret != MOBI_SUCCESS) {
+        mobi_text_reader_close(&reader);
+        free(out);
+        return ret;
+    }
+    length = 0;
+    bool convert = true;
+    const char *chunk;
+    size_t chunk_length;
+    while ((ret = mobi_text_reader_next(&reader, &chunk, &chunk_length)) == MOBI_SUCCESS && chunk_length > 0) {
+        if (length == 0 && chunk_length >= 4 && memcmp(chunk, REPLICA_MAGIC, 4) == 0) {
+            convert = false;
+        }
+        size_t needed = chunk_length;
+        bool last = false;
+        if (convert) {
+            const char *end = memchr(chunk, '\0', chunk_length);
+            if (end) {
+                /* conversion stops on null character */
+                chunk_length = (size_t) (end - chunk);
+                last = true;
+            }
+            needed = mobi_cp1252_to_utf8_length(chunk, chunk_length);
+        }
+        if (capacity - length < needed + 1) {
+            capacity = max(capacity + capacity / 2, length + needed + 1);
+            char *tmp = realloc(out, capacity);
+            if (tmp == NULL) {
+                debug_print("%s", "Memory allocation failed\n");
+                ret = MOBI_MALLOC_FAILED;
+                break;
+            }
+            out = tmp;
+        }
+        if (convert) {
+            size_t out_length = needed + 1;
+            ret = mobi_cp1252_to_utf8(out + length, chunk, &out_length, chunk_length);
+            if (ret != MOBI_SUCCESS) {
+                break;
+            }
+            length += out_length;
+        } else {
+            memcpy(out + length, chunk, chunk_length);
+            length += chunk_length;
+        }
+        if (last) {
+            break;
+        }
+    }
+    mobi_text_reader_close(&reader);
+    if (ret != MOBI_SUCCESS) {
+        free(out);
+        return ret;
+    }
+    out[length] = '\0';
+    if (capacity > length + 1) {
+        char *tmp = realloc(out, length + 1);
+        if (tmp) {
+            out = tmp;
+        }
+    }
+    *text = out;
+    *len = length;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Get trailing entries of text records, parsing them on first use
+ 
+ Extra data at the end of each text record is parsed once, entries are stored in MOBIData
+ and reused by following calls, they are released by mobi_free().
+ Entries of records with corrupt extra data have text_size set to 0.
+ Concurrent calls are safe, entries parsed by the thread that lost the race are discarded.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[out] entries Array of text_record_count entries, NULL if MOBI header has no extra flags
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_get_trailing_entries(const MOBIData *m, const MOBITrailingEntries **entries) {
+    if (m == NULL || entries == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    *entries = NULL;
+    if (m->mh == NULL || m->mh->extra_flags == NULL || *m->mh->extra_flags == 0) {
+        return MOBI_SUCCESS;
+    }
+    if (m->rh == NULL || m->rh->text_record_count == 0) {
+        debug_print("%s", "Text records not found in MOBI header\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    /* entries are a cache, not document data, so they may be attached to const MOBIData */
+    MOBITrailingEntries **cached = (MOBITrailingEntries **) &m->trailing;
+    MOBITrailingEntries *current = __atomic_load_n(cached, __ATOMIC_ACQUIRE);
+    if (current) {
+        *entries = current;
+        return MOBI_SUCCESS;
+    }
+    const uint16_t flags = *m->mh->extra_flags;
+    const size_t count = m->rh->text_record_count;
+    MOBITrailingEntries *parsed = calloc(count, sizeof(*parsed));
+    if (parsed == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    /* text ends at first missing record, entries of following records stay empty */
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, 1 + mobi_get_kf8offset(m));
+    for (size_t i = 0; i < count && curr; i++) {
+        /* failure is reported when the record is decompressed */
+        mobi_parse_trailing_entries(&parsed[i], curr, flags);
+        curr = (i + 1 < count) ? mobi_get_next_record(m, curr) : NULL;
+    }
+    if (__atomic_compare_exchange_n(cached, &current, parsed, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        current = parsed;
+    } else {
+        /* other thread parsed entries in the meantime */
+        free(parsed);
+    }
+    *entries = current;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Get offsets of text records in decompressed text, building them on first use
+ 
+ Offsets are stored in MOBIData and reused by following calls, they are released by mobi_free().
+ Sizes of uncompressed records are taken from records list, compressed records are decompressed once.
+ Concurrent calls are safe, offsets built by the thread that lost the race are discarded.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[out] offsets Array of text_record_count + 1 offsets, last one is the text length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_get_text_offsets(const MOBIData *m, const size_t **offsets) {
+    /* offsets are a cache, not document data, so they may be attached to const MOBIData */
+    size_t **cached = (size_t **) &m->text_offsets;
+    size_t *current = __atomic_load_n(cached, __ATOMIC_ACQUIRE);
+    if (current) {
+        *offsets = current;
+        return MOBI_SUCCESS;
+    }
+    MOBITextReader reader;
+    MOBI_RET ret = mobi_text_reader_open(&reader, m, MOBI_TEXT_RAW);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    const size_t count = m->rh->text_record_count;
+    size_t *built = malloc((count + 1) * sizeof(*built));
+    if (built == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        mobi_text_reader_close(&reader);
+        return MOBI_MALLOC_FAILED;
+    }
+    size_t i = 0;
+    size_t offset = 0;
+    /* as in mobi_get_rawml(), text ends at first missing record */
+    while (reader.remaining && reader.record) {
+        built[i++] = offset;
+        /* uncompressed records are not copied, so their size is known without any work */
+        const unsigned char *data;
+        size_t size;
+        ret = mobi_text_reader_read(&reader, &data, &size);
+        if (ret != MOBI_SUCCESS) {
+            free(built);
+            mobi_text_reader_close(&reader);
+            return ret;
+        }
+        offset += size;
+    }
+    while (i <= count) {
+        built[i++] = offset;
+    }
+    mobi_text_reader_close(&reader);
+    if (__atomic_compare_exchange_n(cached, &current, built, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        current = built;
+    } else {
+        /* other thread built offsets in the meantime */
+        free(built);
+    }
+    *offsets = current;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Decompress part of the text, given by offset and length in decompressed text
+ 
+ Only text records overlapping the range are decompressed.
+ On first call offsets of text records are found and kept in MOBIData, see mobi_get_text_offsets().
+ Text is in document encoding, as returned by mobi_get_rawml().
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] offset Offset of the range in decompressed text
+ @param[in,out] length Length of the range, on return set to length of text actually read, which is shorter if range exceeds the text
+ @param[out] text Memory area of at least (length + 1) bytes to be filled with null terminated text
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_get_text_range(const MOBIData *m, const size_t offset, size_t *length, char *text) {
+    if (length == NULL || text == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    const size_t *offsets;
+    MOBI_RET ret = mobi_get_text_offsets(m, &offsets);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    const size_t count = m->rh->text_record_count;
+    const size_t text_length = offsets[count];
+    if (offset > text_length) {
+        debug_print("Offset %zu beyond text length %zu\n", offset, text_length);
+        return MOBI_PARAM_ERR;
+    }
+    size_t end = text_length;
+    if (*length < text_length - offset) {
+        end = offset + *length;
+    }
+    size_t written = 0;
+    if (offset < end) {
+        /* binary search for the last record starting at or before offset */
+        size_t first = 0;
+        size_t last = count - 1;
+        while (first < last) {
+            const size_t middle = first + (last - first + 1) / 2;
+            if (offsets[middle] <= offset) {
+                first = middle;
+            } else {
+                last = middle - 1;
+            }
+        }
+        MOBITextReader reader;
+        ret = mobi_text_reader_open(&reader, m, MOBI_TEXT_RAW);
+        if (ret == MOBI_SUCCESS) {
+            ret = mobi_text_reader_seek(&reader, first);
+        }
+        size_t position = offsets[first];
+        while (ret == MOBI_SUCCESS && position < end) {
+            const unsigned char *data;
+            size_t size;
+            ret = mobi_text_reader_read(&reader, &data, &size);
+            if (ret != MOBI_SUCCESS) {
+                break;
+            }
+            if (position + size != offsets[++first]) {
+                debug_print("%s", "Text record size changed\n");
+                ret = MOBI_DATA_CORRUPT;
+                break;
+            }
+            const size_t from = (offset > position) ? offset - position : 0;
+            const size_t to = (end < position + size) ? end - position : size;
+            memcpy(text + written, data + from, to - from);
+            written += to - from;
+            position += size;
+        }
+        mobi_text_reader_close(&reader);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    text[written] = '\0';
+    *length = written;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Shared state of threads compressing text records
+ */
+typedef struct {
+    const unsigned char *text; /**< Uncompressed text */
+    size_t length; /**< Length of the text */
+    MOBIPdbRecord *records; /**< Array of records to be filled */
+    MOBI_RET *rets; /**< Status of each record */
+    size_t count; /**< Number of records */
+    size_t next; /**< Index of the next record to be compressed, updated atomically */
+    int level; /**< PalmDOC compression level */
+    const MOBIHuffDict *dict; /**< Dictionary for huff/cdic compression, NULL for PalmDOC compression */
+} MOBICompressJob;
+
+/**
+ @brief Compress single text record
+ 
+ @param[out] record Record to be filled with compressed data
+ @param[in] text Uncompressed text of the record
+ @param[in] length Length of the text, at most RECORD0_TEXT_SIZE_MAX
+ @param[in] job MOBICompressJob structure with compression settings
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_compress_record(MOBIPdbRecord *record, const unsigned char *text, const size_t length, const MOBICompressJob *job) {
+    /* PalmDOC data is at most 1.5 times longer, huffman code is at most 32 bits per byte */
+    size_t size = job->dict ? length * 4 + 1 : length + length / 2 + 1;
+    unsigned char *data = malloc(size);
+    if (data == NULL) {
+        debug_print("%s", "Memory allocation for compressed record failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBI_RET ret;
+    if (job->dict) {
+        ret = mobi_compress_huffman(data, text, &size, length, job->dict);
+    } else {
+        ret = mobi_compress_lz77(data, text, &size, length, job->level);
+    }
+    if (ret != MOBI_SUCCESS) {
+        free(data);
+        return ret;
+    }
+    unsigned char *shrunk = realloc(data, size ? size : 1);
+    record->data = shrunk ? shrunk : data;
+    record->size = size;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Thread routine compressing text records until none is left
+ 
+ @param[in,out] arg MOBICompressJob structure
+ @return NULL
+ */
+static void * mobi_compress_worker(void *arg) {
+    MOBICompressJob *job = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        const size_t offset = i * RECORD0_TEXT_SIZE_MAX;
+        const size_t length = min(job->length - offset, RECORD0_TEXT_SIZE_MAX);
+        job->rets[i] = mobi_compress_record(&job->records[i], job->text + offset, length, job);
+    }
+    return NULL;
+}
+
+/**
+ @brief Compress text into text records
+ 
+ Text is split into records of RECORD0_TEXT_SIZE_MAX bytes, each record is compressed independently.
+ With more than one thread records are compressed concurrently (not available on Windows).
+ 
+ @param[out] records Linked list of compressed text records
+ @param[out] count Number of records
+ @param[in,out] job MOBICompressJob structure with text and compression settings
+ @param[in] threads Number of threads, including the calling one
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_compress_text(MOBIPdbRecord **records, size_t *count, MOBICompressJob *job, const size_t threads) {
+    *records = NULL;
+    *count = 0;
+    const size_t records_count = (job->length + RECORD0_TEXT_SIZE_MAX - 1) / RECORD0_TEXT_SIZE_MAX;
+    if (records_count == 0) {
+        return MOBI_SUCCESS;
+    }
+    /* records are allocated as separate list items, so that they can be freed one by one */
+    MOBIPdbRecord *compressed = calloc(records_count, sizeof(MOBIPdbRecord));
+    MOBI_RET *rets = malloc(records_count * sizeof(MOBI_RET));
+    if (compressed == NULL || rets == NULL) {
+        debug_print("%s", "Memory allocation for compressed records failed\n");
+        free(compressed);
+        free(rets);
+        return MOBI_MALLOC_FAILED;
+    }
+    job->records = compressed;
+    job->rets = rets;
+    job->count = records_count;
+    job->next = 0;
+#ifndef _WIN32
+    size_t threads_count = (threads ? min(threads, records_count) : 1) - 1;
+    pthread_t *workers = malloc((threads_count ? threads_count : 1) * sizeof(pthread_t));
+    if (workers == NULL) {
+        threads_count = 0;
+    }
+    size_t started = 0;
+    while (started < threads_count) {
+        if (pthread_create(&workers[started], NULL, mobi_compress_worker, job) != 0) {
+            debug_print("%s", "Creating compression thread failed\n");
+            break;
+        }
+        started++;
+    }
+    /* current thread also takes part */
+    mobi_compress_worker(job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+#else
+    (void) threads;
+    mobi_compress_worker(job);
+#endif
+    MOBI_RET ret = MOBI_SUCCESS;
+    MOBIPdbRecord *first = NULL;
+    MOBIPdbRecord *last = NULL;
+    for (size_t i = 0; i < records_count; i++) {
+        MOBIPdbRecord *record = NULL;
+        if (rets[i] == MOBI_SUCCESS) {
+            record = malloc(sizeof(MOBIPdbRecord));
+            if (record == NULL) {
+                free(compressed[i].data);
+                rets[i] = MOBI_MALLOC_FAILED;
+            } else {
+                *record = compressed[i];
+                record->next = NULL;
+            }
+        }
+        if (rets[i] != MOBI_SUCCESS) {
+            ret = rets[i];
+            continue;
+        }
+        if (last) {
+            last->next = record;
+        } else {
+            first = record;
+        }
+        last = record;
+    }
+    free(compressed);
+    free(rets);
+    if (ret != MOBI_SUCCESS) {
+        mobi_free_records(first);
+        return ret;
+    }
+    *records = first;
+    *count = records_count;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Compress text into PalmDOC compressed text records
+ 
+ Text is split into records of RECORD0_TEXT_SIZE_MAX bytes, each record is compressed independently.
+ With more than one thread records are compressed concurrently (not available on Windows).
+ Records have no trailing entries, so extra flags in MOBI header should be 0.
+ Returned list must be freed with mobi_free_records().
+ 
+ @param[out] records Linked list of compressed text records
+ @param[out] count Number of records
+ @param[in] text Uncompressed text
+ @param[in] length Length of the text
+ @param[in] level Compression level, from MOBI_LZ77_LEVEL_FASTEST to MOBI_LZ77_LEVEL_MAX
+ @param[in] threads Number of threads, including the calling one
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_compress_palmdoc(MOBIPdbRecord **records, size_t *count, const unsigned char *text, const size_t length, const int level, const size_t threads) {
+    if (records == NULL || count == NULL || (text == NULL && length)) {
+        return MOBI_PARAM_ERR;
+    }
+    if (level < MOBI_LZ77_LEVEL_FASTEST || level > MOBI_LZ77_LEVEL_MAX) {
+        return MOBI_PARAM_ERR;
+    }
+    MOBICompressJob job = {
+        .text = text,
+        .length = length,
+        .level = level,
+        .dict = NULL
+    };
+    return mobi_compress_text(records, count, &job, threads);
+}
+
+/**
+ @brief Get number of bits of symbol index selecting CDIC record
+ 
+ Each CDIC record holds 2^bits symbols, bits are chosen as high as possible,
+ while 16-bit symbol offsets within each record still fit.
+ 
+ @param[in] dict MOBIHuffDict structure
+ @return Number of bits stored as code length in CDIC records
+ */
+static size_t mobi_huffdict_cdic_bits(const MOBIHuffDict *dict) {
+    size_t bits = CDIC_CODE_LENGTH_MAX;
+    while (bits > 1) {
+        const size_t per_record = (size_t) 1 << bits;
+        bool fits = true;
+        for (size_t first = 0; first < dict->count && fits; first += per_record) {
+            const size_t last = min(first + per_record, dict->count);
+            /* offsets are counted from the start of the offsets table */
+            size_t offset = (last - first) * 2;
+            for (size_t i = first; i < last - 1; i++) {
+                offset += 2 + dict->lengths[i];
+            }
+            fits = (offset <= UINT16_MAX);
+        }
+        if (fits) {
+            break;
+        }
+        bits--;
+    }
+    return bits;
+}
+
+/**
+ @brief Create HUFF record from huffman dictionary
+ 
+ Tables are stored big-endian, followed by their little-endian copies.
+ 
+ @param[out] record Record to be filled
+ @param[in] dict MOBIHuffDict structure with assigned codes
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffdict_huff_record(MOBIPdbRecord *record, const MOBIHuffDict *dict) {
+    const uint32_t data1_offset = HUFF_HEADER_LEN;
+    const uint32_t data2_offset = data1_offset + 256 * 4;
+    const uint32_t data1_le_offset = data2_offset + 64 * 4;
+    const uint32_t data2_le_offset = data1_le_offset + 256 * 4;
+    MOBIBuffer *buf = buffer_init(HUFF_RECORD_MINSIZE);
+    if (buf == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    buffer_addstring(buf, HUFF_MAGIC);
+    buffer_add32(buf, HUFF_HEADER_LEN);
+    buffer_add32(buf, data1_offset);
+    buffer_add32(buf, data2_offset);
+    buffer_add32(buf, data1_le_offset);
+    buffer_add32(buf, data2_le_offset);
+    uint32_t data2[64];
+    for (size_t i = 0; i < 32; i++) {
+        data2[2 * i] = dict->mincode[i + 1];
+        data2[2 * i + 1] = dict->maxcode[i + 1];
+    }
+    for (size_t i = 0; i < 256; i++) {
+        buffer_add32(buf, dict->table1[i]);
+    }
+    for (size_t i = 0; i < 64; i++) {
+        buffer_add32(buf, data2[i]);
+    }
+    for (size_t i = 0; i < 256 + 64; i++) {
+        const uint32_t value = (i < 256) ? dict->table1[i] : data2[i - 256];
+        buffer_add8(buf, (uint8_t) value);
+        buffer_add8(buf, (uint8_t) (value >> 8));
+        buffer_add8(buf, (uint8_t) (value >> 16));
+        buffer_add8(buf, (uint8_t) (value >> 24));
+    }
+    const MOBI_RET ret = buf->error;
+    if (ret != MOBI_SUCCESS) {
+        buffer_free(buf);
+        return ret;
+    }
+    record->data = buf->data;
+    record->size = buf->offset;
+    buffer_free_null(buf);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Create CDIC record from huffman dictionary
+ 
+ @param[out] record Record to be filled
+ @param[in] dict MOBIHuffDict structure with assigned codes
+ @param[in] num Number of CDIC record in a set, starting from zero
+ @param[in] bits Number of bits of symbol index selecting CDIC record
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffdict_cdic_record(MOBIPdbRecord *record, const MOBIHuffDict *dict, const size_t num, const size_t bits) {
+    const size_t first = num << bits;
+    const size_t last = min(first + ((size_t) 1 << bits), dict->count);
+    size_t size = CDIC_HEADER_LEN + (last - first) * 2;
+    for (size_t i = first; i < last; i++) {
+        size += 2 + dict->lengths[i];
+    }
+    MOBIBuffer *buf = buffer_init(size);
+    if (buf == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    buffer_addstring(buf, CDIC_MAGIC);
+    buffer_add32(buf, CDIC_HEADER_LEN);
+    buffer_add32(buf, (uint32_t) dict->count);
+    buffer_add32(buf, (uint32_t) bits);
+    size_t offset = (last - first) * 2;
+    for (size_t i = first; i < last; i++) {
+        buffer_add16(buf, (uint16_t) offset);
+        offset += 2 + dict->lengths[i];
+    }
+    for (size_t i = first; i < last; i++) {
+        /* symbols are stored uncompressed, flagged with the highest bit */
+        buffer_add16(buf, 0x8000 | dict->lengths[i]);
+        buffer_addraw(buf, dict->symbols[i], dict->lengths[i]);
+    }
+    const MOBI_RET ret = buf->error;
+    if (ret != MOBI_SUCCESS) {
+        buffer_free(buf);
+        return ret;
+    }
+    record->data = buf->data;
+    record->size = buf->offset;
+    buffer_free_null(buf);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Create HUFF and CDIC records from huffman dictionary
+ 
+ @param[out] records Linked list of HUFF record followed by CDIC records
+ @param[out] count Number of records
+ @param[in] dict MOBIHuffDict structure with assigned codes
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffdict_records(MOBIPdbRecord **records, size_t *count, const MOBIHuffDict *dict) {
+    const size_t bits = mobi_huffdict_cdic_bits(dict);
+    const size_t cdic_count = ((dict->count - 1) >> bits) + 1;
+    MOBIPdbRecord *first = NULL;
+    MOBIPdbRecord *last = NULL;
+    MOBI_RET ret = MOBI_SUCCESS;
+    for (size_t i = 0; i <= cdic_count; i++) {
+        MOBIPdbRecord *record = calloc(1, sizeof(MOBIPdbRecord));
+        if (record == NULL) {
+            debug_print("%s", "Memory allocation for HUFF/CDIC record failed\n");
+            ret = MOBI_MALLOC_FAILED;
+            break;
+        }
+        if (i == 0) {
+            ret = mobi_huffdict_huff_record(record, dict);
+        } else {
+            ret = mobi_huffdict_cdic_record(record, dict, i - 1, bits);
+        }
+        if (ret != MOBI_SUCCESS) {
+            free(record);
+            break;
+        }
+        if (last) {
+            last->next = record;
+        } else {
+            first = record;
+        }
+        last = record;
+    }
+    if (ret != MOBI_SUCCESS) {
+        mobi_free_records(first);
+        return ret;
+    }
+    *records = first;
+    *count = cdic_count + 1;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Compress text into huff/cdic compressed text records
+ 
+ Dictionary of frequent substrings is built from the whole text and stored in HUFF and CDIC records.
+ Text is split into records of RECORD0_TEXT_SIZE_MAX bytes, each record is compressed independently.
+ With more than one thread records are compressed concurrently (not available on Windows).
+ Records have no trailing entries, so extra flags in MOBI header should be 0.
+ HUFF record index and HUFF/CDIC records count in MOBI header must point to returned huffcdic records.
+ Both returned lists must be freed with mobi_free_records().
+ 
+ @param[out] records Linked list of compressed text records
+ @param[out] count Number of text records
+ @param[out] huffcdic Linked list of HUFF record followed by CDIC records
+ @param[out] huffcdic_count Number of HUFF and CDIC records
+ @param[in] text Uncompressed text
+ @param[in] length Length of the text
+ @param[in] threads Number of threads, including the calling one
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_compress_huffcdic(MOBIPdbRecord **records, size_t *count, MOBIPdbRecord **huffcdic, size_t *huffcdic_count, const unsigned char *text, const size_t length, const size_t threads) {
+    if (records == NULL || count == NULL || huffcdic == NULL || huffcdic_count == NULL || (text == NULL && length)) {
+        return MOBI_PARAM_ERR;
+    }
+    *huffcdic = NULL;
+    *huffcdic_count = 0;
+    MOBIHuffDict *dict;
+    MOBI_RET ret = mobi_build_huffdict(&dict, text, length, RECORD0_TEXT_SIZE_MAX);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    MOBICompressJob job = {
+        .text = text,
+        .length = length,
+        .level = 0,
+        .dict = dict
+    };
+    ret = mobi_compress_text(records, count, &job, threads);
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_huffdict_records(huffcdic, huffcdic_count, dict);
+        if (ret != MOBI_SUCCESS) {
+            mobi_free_records(*records);
+            *records = NULL;
+            *count = 0;
+        }
+    }
+    mobi_free_huffdict(dict);
+    return ret;
+}
+
 /**
  @brief Check if MOBI header is loaded / present in the loaded file
  
@@ -1280,20 +3435,18 @@ MOBI_RET mobi_decode_audio_resource(unsigned char **decoded_resource, size_t *de
         debug_print("Audio resource record too short (%zu)\n", part->size);
         return MOBI_DATA_CORRUPT;
     }
-    MOBIBuffer *buf = buffer_init_null(part->size);
-    buf->data = part->data;
+    MOBIBuffer buf_view;
+    MOBIBuffer *buf = buffer_init_view(&buf_view, part->data, part->size);
     char magic[5];
     buffer_getstring(magic, buf, 4);
     if (strncmp(magic, AUDI_MAGIC, 4) != 0) {
         debug_print("Wrong magic for audio resource: %s\n", magic);
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     uint32_t offset = buffer_get32(buf);
     buf->offset = offset;
     *decoded_size = buf->maxlen - buf->offset;
     *decoded_resource = buf->data;
-    buffer_free_null(buf);
     return MOBI_SUCCESS;
 }
 
@@ -1330,13 +3483,12 @@ MOBI_RET mobi_decode_video_resource(unsigned char **decoded_resource, size_t *de
         debug_print("Video resource record too short (%zu)\n", part->size);
         return MOBI_DATA_CORRUPT;
     }
-    MOBIBuffer *buf = buffer_init_null(part->size);
-    buf->data = part->data;
+    MOBIBuffer buf_view;
+    MOBIBuffer *buf = buffer_init_view(&buf_view, part->data, part->size);
     char magic[5];
     buffer_getstring(magic, buf, 4);
     if (strncmp(magic, VIDE_MAGIC, 4) != 0) {
         debug_print("Wrong magic for audio resource: %s\n", magic);
-        buffer_free_null(buf);
         return MOBI_DATA_CORRUPT;
     }
     uint32_t offset = buffer_get32(buf);
@@ -1344,7 +3496,6 @@ MOBI_RET mobi_decode_video_resource(unsigned char **decoded_resource, size_t *de
     buf->offset = offset;
     *decoded_size = buf->maxlen - buf->offset;
     *decoded_resource = buf->data;
-    buffer_free_null(buf);
     return MOBI_SUCCESS;
 }
 
@@ -1758,12 +3909,21 @@ MOBI_RET mobi_swap_mobidata(MOBIData *m) {
     tmp->rh = m->rh;
     tmp->mh = m->mh;
     tmp->eh = m->eh;
+    tmp->huffcdic = m->huffcdic;
+    tmp->text_offsets = m->text_offsets;
+    tmp->trailing = m->trailing;
     m->rh = m->next->rh;
     m->mh = m->next->mh;
     m->eh = m->next->eh;
+    m->huffcdic = m->next->huffcdic;
+    m->text_offsets = m->next->text_offsets;
+    m->trailing = m->next->trailing;
     m->next->rh = tmp->rh;
     m->next->mh = tmp->mh;
     m->next->eh = tmp->eh;
+    m->next->huffcdic = tmp->huffcdic;
+    m->next->text_offsets = tmp->text_offsets;
+    m->next->trailing = tmp->trailing;
     free(tmp);
     tmp = NULL;
     return MOBI_SUCCESS;
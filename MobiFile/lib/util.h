@@ -95,6 +95,7 @@
 #define CDIC_HEADER_LEN 16
 #define HUFF_HEADER_LEN 24
 #define HUFF_RECORD_MINSIZE 2584
+#define CDIC_CODE_LENGTH_MAX 12 /**< Maximal number of index bits selecting CDIC record, written by huffman compressor */
 #define FONT_HEADER_LEN 24
 #define MEDIA_HEADER_LEN 12
 /** @} */
@@ -120,11 +121,18 @@ typedef enum {
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
 int mobi_bitcount(uint8_t byte);
+MOBI_RET mobi_build_record_uidmap(MOBIRecordIndex *index);
+MOBI_RET mobi_build_record_index(MOBIData *m);
+MOBIPdbRecord * mobi_get_next_record(const MOBIData *m, const MOBIPdbRecord *record);
+MOBI_RET mobi_get_huffcdic(const MOBIData *m, const MOBIHuffCdic **huffcdic);
 MOBI_RET mobi_delete_record_by_seqnumber(MOBIData *m, size_t num);
 MOBI_RET mobi_swap_mobidata(MOBIData *m);
+MOBI_RET mobi_get_rawml_utf8(const MOBIData *m, char **text, size_t *len);
 char * mobi_strdup(const char *s);
 bool mobi_is_cp1252(const MOBIData *m);
+MOBIExthHeader * mobi_get_exthrecord_by_tag(const MOBIData *m, const MOBIExthTag tag);
 MOBI_RET mobi_cp1252_to_utf8(char *output, const char *input, size_t *outsize, const size_t insize);
+size_t mobi_cp1252_to_utf8_length(const char *input, const size_t insize);
 MOBIPart * mobi_get_part_by_uid(const MOBIRawml *rawml, const size_t uid);
 size_t mobi_get_first_resource_record(const MOBIData *m);
 MOBIFiletype mobi_determine_resource_type(const MOBIPdbRecord *record);